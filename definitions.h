@@ -9,9 +9,14 @@
 
 extern FILE* vmread_dfile;
 
+#define MODE_AUTO() 0
 #define MODE_EXTERNAL() 1
 #define MODE_QEMU_INJECT() 2
 #define MODE_DMA() 3
+#define MODE_FILE() 4
+#define MODE_KMOD() 5
+#define MODE_PROCMEM() 6
+#define MODE_MAPPED() 7
 
 #define DMSG(...) fprintf(vmread_dfile ? vmread_dfile : stdout, __VA_ARGS__)
 #define NMSG(...)
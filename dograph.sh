@@ -12,7 +12,7 @@ if [[ -z $(lsmod | grep vmread ) ]]; then
 fi
 
 echo "Running external mode..."
-sudo ./build/example | tail -n 5 > read_external
+sudo VMREAD_MODE=external ./build/example | tail -n 5 > read_external
 echo "Running kernel mapped mode..."
-sudo ./build/kmod_example | tail -n 5 > read_kmod
+sudo VMREAD_MODE=kmod ./build/example | tail -n 5 > read_kmod
 gnuplot perf_plot.p
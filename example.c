@@ -5,31 +5,19 @@
 #include <sys/types.h>
 #include <string.h>
 
-#define STRINGIFY(x) #x
-#define TOSTRING(x) STRINGIFY(x)
-
 FILE* dfile;
 
 __attribute__((constructor))
 void init()
 {
 	FILE* out = stdout;
-	pid_t pid;
-#if (LMODE() == MODE_EXTERNAL())
-	FILE* pipe = popen("pidof qemu-system-x86_64", "r");
-	fscanf(pipe, "%d", &pid);
-	pclose(pipe);
-#else
-	out = fopen("/tmp/testr.txt", "w");
-	pid = getpid();
-#endif
-	fprintf(out, "Using Mode: %s\n", TOSTRING(LMODE));
 
 	dfile = out;
 
 	WinCtx ctx;
-	int ret = InitializeContext(&ctx, pid);
+	int ret = InitializeContext(&ctx, 0);
 	fprintf(out, "Initialization status: %d\n", ret);
+	fprintf(out, "Using Mode: %s\n", ctx.process.backend.name ? ctx.process.backend.name : "none");
 
 	if (!ret) {
 		if (0) {
@@ -6,9 +6,7 @@
 #include <string.h>
 #include <random>
 #include <chrono>
-
-#define STRINGIFY(x) #x
-#define TOSTRING(x) STRINGIFY(x)
+#include <memory>
 
 FILE* dfile;
 extern int vtTLBHits, vtTLBMisses;
@@ -89,6 +87,15 @@ static const size_t chunkCounts[] =
 	1
 };
 
+/* The last entry is the single threaded run, whose results get plotted by dograph.sh */
+static const size_t threadCounts[] =
+{
+	8,
+	4,
+	2,
+	1
+};
+
 static const size_t readSize = 64;
 
 static void runfullbench(FILE* out, const WinProcess& process, size_t start, size_t end)
@@ -108,20 +115,43 @@ static void runfullbench(FILE* out, const WinProcess& process, size_t start, siz
 	}
 }
 
+static int parsemode(const char* mode)
+{
+	if (!mode)
+		return MODE_AUTO();
+
+	const MemBackend* backends[] = { &memBackendExternal, &memBackendInject, &memBackendKmod, &memBackendMapped, &memBackendProcMem };
+
+	for (const MemBackend* i : backends)
+		if (!strcmp(mode, i->name))
+			return i->mode;
+
+	return MODE_AUTO();
+}
+
+static void runthreadbench(FILE* out, const WinProcess& process, size_t start, size_t end)
+{
+	for (const size_t i : threadCounts) {
+		fprintf(out, "Threads: %zu\n", i);
+		SetMemThreads(i);
+		runfullbench(out, process, start, end);
+	}
+}
+
 __attribute__((constructor))
 static void init()
 {
 	FILE* out = stdout;
-	pid_t pid = 0;
-#if (LMODE() != MODE_EXTERNAL())
-	pid = getpid();
-#endif
-	fprintf(out, "Using Mode: %s\n", TOSTRING(LMODE));
+	const char* memFile = getenv("VMREAD_MEMFILE");
+	int mode = parsemode(getenv("VMREAD_MODE"));
 
 	vmread_dfile = out;
 
 	try {
-		WinContext ctx(pid);
+		std::unique_ptr<WinContext> pctx(memFile ? new WinContext(memFile) : new WinContext(0, mode));
+		WinContext& ctx = *pctx;
+		fprintf(out, "Using Mode: %s\n", ctx.ctx.process.backend.name);
+
 		ctx.processList.Refresh();
 
 		fprintf(out, "Process List:\nPID\tVIRT\t\t\tPHYS\t\tBASE\t\tNAME\n");
@@ -162,7 +192,21 @@ static void init()
 				fprintf(out, "Performing memory benchmark...\n");
 				SetMemCacheTime(1000);
 				FlushTlb(GetTlb());
-				runfullbench(out, *steam, mod->info.baseAddress, mod->info.baseAddress + mod->info.sizeOfModule);
+				size_t start = mod->info.baseAddress;
+				size_t end = mod->info.baseAddress + mod->info.sizeOfModule;
+				MemBackend backend = ctx.ctx.process.backend;
+
+				/* Compare process_vm_readv against pread on /proc/<pid>/mem, the selected backend goes last */
+				if (backend.mode == MODE_EXTERNAL() && !OpenProcMem(&ctx.ctx.process)) {
+					fprintf(out, "Backend: %s\n", memBackendProcMem.name);
+					SetMemBackend(&ctx.ctx.process, &memBackendProcMem);
+					runthreadbench(out, *steam, start, end);
+					SetMemBackend(&ctx.ctx.process, &backend);
+					CloseProcMem(&ctx.ctx.process);
+				}
+
+				fprintf(out, "Backend: %s\n", backend.name);
+				runthreadbench(out, *steam, start, end);
 				SetMemCacheTime(GetDefaultMemCacheTime());
 			}
 		}
@@ -0,0 +1,45 @@
+#include "mem.h"
+#include "filemem.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Maps a guest physical memory image file into our address space, memBackendFile then reads it in place like the other mapped backends */
+
+int MapMemFile(ProcessData* data, const char* path)
+{
+	int fd = open(path, O_RDONLY);
+
+	if (fd == -1)
+		return -1;
+
+	struct stat st;
+
+	if (fstat(fd, &st) || st.st_size <= 0) {
+		close(fd);
+		return -1;
+	}
+
+	/* A private mapping is used so that writes never end up in the image, and the file can stay read-only */
+	void* map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return -1;
+
+	data->mapsStart = (uint64_t)map;
+	data->mapsSize = (uint64_t)st.st_size;
+	data->pid = 0;
+
+	return 0;
+}
+
+void UnmapMemFile(ProcessData* data)
+{
+	if (data->mapsStart)
+		munmap((void*)data->mapsStart, data->mapsSize);
+
+	data->mapsStart = 0;
+	data->mapsSize = 0;
+}
@@ -0,0 +1,44 @@
+#ifndef FILEMEM_H
+#define FILEMEM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @file filemem.h
+ * @brief Defines memory image file operations
+ *
+ * Allows to run vmread against a raw guest physical memory image instead of a live VM
+ */
+
+#include "definitions.h"
+
+/**
+ * @brief Map a raw guest physical memory image
+ *
+ * @param data VM process data to be filled in
+ * @param path path to the image file
+ *
+ * The image has to have the same layout as the QEMU RAM block, which is the case for files used by
+ * memory-backend-file, as well as raw copies of them. The file is mapped privately, thus writes
+ * performed through MemWrite stay local and do not modify the file.
+ *
+ * @return
+ * 0 on success;
+ * -1 otherwise
+ */
+int MapMemFile(ProcessData* data, const char* path);
+
+/**
+ * @brief Unmap a memory image mapped with MapMemFile
+ *
+ * @param data VM process data
+ */
+void UnmapMemFile(ProcessData* data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
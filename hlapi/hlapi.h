@@ -171,6 +171,19 @@ class WriteList
 	std::vector<char> buffer;
 };
 
+class MemView
+{
+  public:
+	using iterator = std::vector<MemSpan>::iterator;
+	iterator begin() { return spans.begin(); }
+	iterator end() { return spans.end(); }
+	ssize_t size;
+	std::vector<MemSpan> spans;
+  private:
+	friend class WinProcess;
+	std::vector<char> buffer;
+};
+
 class WinProcess
 {
   public:
@@ -186,6 +199,7 @@ class WinProcess
 
 	ssize_t Read(uint64_t address, void* buffer, size_t sz);
 	ssize_t Write(uint64_t address, void* buffer, size_t sz);
+	MemView View(uint64_t address, size_t sz);
 
 	template<typename T>
 	T Read(uint64_t address)
@@ -273,9 +287,18 @@ class WinContext
 		MemWrite(&ctx.process, (uint64_t)&value, address, sizeof(T));
 	}
 
-	WinContext(pid_t pid)
+	WinContext(pid_t pid, int mode = MODE_AUTO())
+	{
+		int ret = InitializeContextMode(&ctx, pid, mode);
+		if (ret)
+			throw VMException(ret);
+		processList = WinProcessList(&ctx);
+		systemModuleList.proc.ctx = &ctx;
+	}
+
+	WinContext(const char* path)
 	{
-		int ret = InitializeContext(&ctx, pid);
+		int ret = InitializeFileContext(&ctx, path);
 		if (ret)
 			throw VMException(ret);
 		processList = WinProcessList(&ctx);
@@ -151,3 +151,21 @@ ssize_t WinProcess::Write(uint64_t address, void* buffer, size_t sz)
 	return VMemWrite(&ctx->process, proc.dirBase, (uint64_t)buffer, address, sz);
 }
 
+/* Spans point directly into the guest memory when it is mapped, otherwise the range gets copied into the view */
+MemView WinProcess::View(uint64_t address, size_t sz)
+{
+	MemView view;
+	size_t count = 1;
+
+	if (ctx->process.backend.map)
+		count = ((address & 0xfff) + sz + 0xfff) / 0x1000;
+	else
+		view.buffer.resize(sz);
+
+	view.spans.resize(count ? count : 1);
+	view.size = VMemView(&ctx->process, proc.dirBase, address, sz, (uint64_t)view.buffer.data(), view.spans.data(), &count);
+	view.spans.resize(view.size == -1 ? 0 : count);
+
+	return view;
+}
+
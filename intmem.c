@@ -1,56 +1,107 @@
 #include "mem.h"
 #include <string.h>
 
-/* Implementation for direct memory reads, used when injected into the QEMU process */
+/* Implementation for direct memory reads, used when injected into the QEMU process, or when the VM memory is mapped into our address space (by the kernel module, through the shared memory backend file, or from a memory image file) */
 
-extern uint64_t KFIXC;
-extern uint64_t KFIXO;
-uint64_t KFIXC = 0x80000000;
-uint64_t KFIXO = 0x80000000;
-#define KFIX2(x) ((x) < KFIXC ? (x) : ((x) - KFIXO))
-
-ssize_t MemRead(const ProcessData* data, uint64_t localAddr, uint64_t remoteAddr, size_t len)
+static ssize_t IntMemRead(const ProcessData* data, uint64_t localAddr, uint64_t remoteAddr, size_t len)
 {
-	uint64_t remote = KFIX2(remoteAddr);
-	if (remote >= data->mapsSize - len)
+	uint64_t remote = GetMemMapping(data, remoteAddr, len);
+	if (!remote)
 		return -1;
-	memcpy((void*)localAddr, (void*)(remote + data->mapsStart), len);
+	memcpy((void*)localAddr, (void*)remote, len);
 	return len;
 }
 
-ssize_t MemReadMul(const ProcessData* data, RWInfo* rdata, size_t num)
+static ssize_t IntMemReadMul(const ProcessData* data, RWInfo* rdata, size_t num, ssize_t* status)
 {
-    ssize_t flen = 0;
-	size_t i;
+	ssize_t flen = 0;
+	size_t i, valid = 0;
 	for (i = 0; i < num; i++) {
-		uint64_t remote = KFIX2(rdata[i].remote);
-		if (remote >= data->mapsSize - rdata[i].size)
-			return -1;
-		memcpy((void*)rdata[i].local, (void*)(remote + data->mapsStart), rdata[i].size);
+		uint64_t remote = GetMemMapping(data, rdata[i].remote, rdata[i].size);
+		if (!remote) {
+			if (status)
+				status[i] = RW_OUT_OF_RANGE;
+			continue;
+		}
+		memcpy((void*)rdata[i].local, (void*)remote, rdata[i].size);
+		if (status)
+			status[i] = rdata[i].size;
 		flen += rdata[i].size;
+		valid++;
 	}
-	return flen;
+	return num && !valid ? -1 : flen;
 }
 
-ssize_t MemWrite(const ProcessData* data, uint64_t localAddr, uint64_t remoteAddr, size_t len)
+static ssize_t IntMemWrite(const ProcessData* data, uint64_t localAddr, uint64_t remoteAddr, size_t len)
 {
-	uint64_t remote = KFIX2(remoteAddr);
-	if (remote >= data->mapsSize - len)
+	uint64_t remote = GetMemMapping(data, remoteAddr, len);
+	if (!remote)
 		return -1;
-	memcpy((void*)(remote + data->mapsStart), (void*)localAddr, len);
+	memcpy((void*)remote, (void*)localAddr, len);
 	return len;
 }
 
-ssize_t MemWriteMul(const ProcessData* data, RWInfo* wdata, size_t num)
+static ssize_t IntMemWriteMul(const ProcessData* data, RWInfo* wdata, size_t num, ssize_t* status)
 {
 	ssize_t flen = 0;
-	size_t i;
+	size_t i, valid = 0;
 	for (i = 0; i < num; i++) {
-		uint64_t remote = KFIX2(wdata[i].remote);
-		if (remote >= data->mapsSize - wdata[i].size)
-			return -1;
-		memcpy((void*)(remote + data->mapsStart), (void*)wdata[i].local, wdata[i].size);
+		uint64_t remote = GetMemMapping(data, wdata[i].remote, wdata[i].size);
+		if (!remote) {
+			if (status)
+				status[i] = RW_OUT_OF_RANGE;
+			continue;
+		}
+		memcpy((void*)remote, (void*)wdata[i].local, wdata[i].size);
+		if (status)
+			status[i] = wdata[i].size;
 		flen += wdata[i].size;
+		valid++;
 	}
-	return flen;
+	return num && !valid ? -1 : flen;
+}
+
+static uint64_t IntMemMap(const ProcessData* data, uint64_t remote, size_t size)
+{
+	return GetMemMapping(data, remote, size);
 }
+
+const MemBackend memBackendInject = {
+	.name = "qemu_inject",
+	.mode = MODE_QEMU_INJECT(),
+	.read = IntMemRead,
+	.write = IntMemWrite,
+	.readMul = IntMemReadMul,
+	.writeMul = IntMemWriteMul,
+	.map = IntMemMap
+};
+
+const MemBackend memBackendKmod = {
+	.name = "kmod",
+	.mode = MODE_KMOD(),
+	.read = IntMemRead,
+	.write = IntMemWrite,
+	.readMul = IntMemReadMul,
+	.writeMul = IntMemWriteMul,
+	.map = IntMemMap
+};
+
+const MemBackend memBackendMapped = {
+	.name = "mapped",
+	.mode = MODE_MAPPED(),
+	.read = IntMemRead,
+	.write = IntMemWrite,
+	.readMul = IntMemReadMul,
+	.writeMul = IntMemWriteMul,
+	.map = IntMemMap
+};
+
+const MemBackend memBackendFile = {
+	.name = "file",
+	.mode = MODE_FILE(),
+	.read = IntMemRead,
+	.write = IntMemWrite,
+	.readMul = IntMemReadMul,
+	.writeMul = IntMemWriteMul,
+	.map = IntMemMap
+};
@@ -3,15 +3,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <pthread.h>
 
 #ifndef NO_ASSERTS
 #include <assert.h>
 #endif
 
-#if (LMODE() == MODE_EXTERNAL() && !defined(KMOD_MEMMAP))
-#define USE_PAGECACHE
-#endif
-
 /* For how long should the cached page be valid */
 #ifndef VT_CACHE_TIME_MS
 #define VT_CACHE_TIME_MS 1
@@ -19,388 +16,3347 @@
 
 static size_t vtCacheTimeMS = VT_CACHE_TIME_MS;
 
-#define VT_CACHE_TIME_NS vtCacheTimeMS * 1000000ll
+/*
+  Cache entries store the epoch they were filled in, instead of a timestamp. A timer thread advances the shared epoch
+  every half of the cache time, and entries stay valid for as long as the epoch did not move by VT_EPOCH_WINDOW, which
+  gives them a lifetime between half and the full cache time. Reading the epoch is a single load, and checking an
+  entry a subtraction and a compare, with no clock reads involved. The timer is started by the first translation,
+  sleeps while caching is disabled, and runs until StopMemCacheTimer.
+*/
+#define VT_EPOCH_WINDOW 2
+
+static uint32_t vtEpoch = VT_EPOCH_WINDOW;
+/* VT_EPOCH_WINDOW, or 0 when caching is disabled */
+static uint32_t vtEpochWindow = VT_EPOCH_WINDOW;
+
+/*
+  Failed translations are cached as negative entries, which are kept for a shorter window, since the guest pages
+  in memory the moment it touches it. 0 disables them.
+*/
+#ifndef VT_NEGATIVE_WINDOW
+#define VT_NEGATIVE_WINDOW 1
+#endif
+
+static uint32_t vtNegativeWindow = VT_NEGATIVE_WINDOW;
+
+/*
+  Kernel half translations with the global bit set are the same in every address space. They are cached under
+  the dirBase of the system process, where lookups from any other address space find them after a miss on
+  their own entries. 0 disables the sharing.
+*/
+static uint64_t vtKernelDirBase = 0;
+static int vtEpochTimerStarted = 0;
+static int vtEpochTimerStopping = 0;
+static int vtEpochWakeInitialized = 0;
+static pthread_t vtEpochThread;
+static pthread_mutex_t vtEpochLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t vtEpochWake;
 
 /*
   This is used to cache the pages touched last bu reads of VTranslate, this increases the performance of external mode by at least 2x for multiple consequitive reads in common area. Cached page expires after a set interval which should be small enough not to cause very serious harm
 */
 
-// This makes the cache fit in 12 pages
+/*
+  The TLB is set-associative, every entry covers a whole page of its size class, thus a large page takes up a single
+  entry. Each size class indexes the sets with its own page number, and a lookup probes the sets of all of them.
+*/
 #ifndef TLB_SIZE
 #define TLB_SIZE 1024
 #endif
 
+#ifndef TLB_WAYS
+#define TLB_WAYS 4
+#endif
+
+#define TLB_SETS (TLB_SIZE / TLB_WAYS)
+
 typedef struct {
 	uint64_t page;
 	uint64_t dirBase;
 	uint64_t translation;
+	uint32_t epoch;
+	uint8_t size;
+	/* Set on every hit, and cleared by the CLOCK hand as it passes by */
+	uint8_t referenced;
+	/* 0, or why the translation failed for negative entries */
+	int8_t fault;
+	/* Kernel translation with the global bit set, which every address space may use */
+	uint8_t global;
 } tlbentry_t;
 
 typedef struct {
-	size_t tlbHits;
-	size_t tlbMisses;
+	tlbentry_t ways[TLB_WAYS];
+	size_t hand;
+} tlbset_t;
+
+/*
+  Address spaces can reserve ways of every TLB set, which the fills of other address spaces never replace.
+  Ways are handed out from the bottom of the set in the order of the reservations, and the ones left over are
+  shared by everybody. Threads copy the table into their TLB whenever its generation changes, so that fills
+  do not need to lock anything.
+*/
+#ifndef MAX_TLB_RESERVATIONS
+#define MAX_TLB_RESERVATIONS 8
+#endif
+
+#define TLB_ALL_WAYS ((uint32_t)((1ull << TLB_WAYS) - 1))
+
+typedef struct {
+	pthread_mutex_t lock;
+	uint32_t generation;
+	size_t count;
+	uint64_t dirBases[MAX_TLB_RESERVATIONS];
+	size_t ways[MAX_TLB_RESERVATIONS];
+} tlbreservations_t;
+
+/* Threads start at generation 0, which makes them copy the table on their first fill */
+static tlbreservations_t tlbReservations = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.generation = 1,
+	.count = 0
+};
+
+/*
+  Paging-structure cache, keeps the upper level entries (PML4E, PDPTE and PDE) of recent walks, so that a TLB miss
+  on a new page within an already known 2MB or 1GB region only needs to read the entries below the cached one.
+*/
+#ifndef PSC_SIZE
+#define PSC_SIZE 64
+#endif
+
+#define PSC_LEVELS 3
+
+typedef struct {
+	uint64_t prefix;
+	uint64_t dirBase;
+	uint64_t entry;
+	uint32_t epoch;
+} pscentry_t;
+
+/*
+  Per-thread scratch memory for the temporary arrays of the batched operations. Allocations are released in reverse
+  order by going back to a mark. Running out of room chains a bigger block, and once every mark is released again
+  the chain is replaced by a single block as large as it ever got, thus repeating requests stop allocating.
+  Allocations return NULL when memory runs out, and the request that needed them fails.
+*/
+#ifndef SCRATCH_MIN_SIZE
+#define SCRATCH_MIN_SIZE 0x10000
+#endif
+
+#define SCRATCH_ALIGN(x) (((x) + 15) & ~(size_t)15)
+
+typedef struct scratchblock_t {
+	struct scratchblock_t* prev;
+	size_t size;
+	size_t used;
+} scratchblock_t;
 
-	struct timespec curTime;
-	struct timespec entryTimes[TLB_SIZE];
-	tlbentry_t entries[TLB_SIZE];
+typedef struct {
+	scratchblock_t* block;
+	size_t used;
+} scratchmark_t;
 
-#ifdef USE_PAGECACHE
-	uint64_t pageCachePage[4];
-	char pageCache[4][0x1000];
-	struct timespec pageCacheTime[4];
+/*
+  Readahead streams of VMemRead. A stream is a run of reads within one address space moving forward by the same
+  number of pages, and is confirmed once the same stride was seen twice. The next pages of a confirmed stream are
+  loaded into the guest page cache in one batch, starting with READAHEAD_MIN_WINDOW pages and doubling with every
+  batch. A new batch is started when the reads get past half of the previous one, so that they never have to wait.
+*/
+#ifndef READAHEAD_STREAMS
+#define READAHEAD_STREAMS 4
 #endif
+
+#define READAHEAD_MIN_WINDOW 4
+#define READAHEAD_MAX_STRIDE 16
+
+typedef struct {
+	uint64_t dirBase;
+	/* Virtual page numbers of the last read, and of the first page not loaded yet, 0 before the first batch */
+	uint64_t lastPage;
+	uint64_t next;
+	uint64_t stride;
+	size_t window;
+	size_t lastBatch;
+	uint32_t lastUse;
+} rastream_t;
+
+typedef struct _tlb_t {
+	tlb_t stats;
+
+	/* Why the last page walk failed, RW_UNMAPPED or RW_PAGED_OUT, and the size class of the entry it failed at */
+	ssize_t lastFault;
+	int lastFaultSize;
+	/* Whether the leaf entry of the last successful walk had the global bit set */
+	int lastGlobal;
+
+	uint32_t curEpoch;
+	tlbset_t sets[TLB_SETS];
+
+	/* Copy of tlbReservations, as masks of the ways each address space may fill */
+	uint32_t reservationGeneration;
+	size_t reservationCount;
+	uint64_t reservedDirBases[MAX_TLB_RESERVATIONS];
+	uint32_t reservedWays[MAX_TLB_RESERVATIONS];
+	uint32_t sharedWays;
+
+	/* Indexed by the level, 0 being PML4E */
+	pscentry_t psc[PSC_LEVELS][PSC_SIZE];
+
+	/* Only used by backends that need a syscall per read, one page per level with the PML5 last */
+	uint64_t pageCachePage[5];
+	char pageCache[5][0x1000];
+	uint32_t pageCacheEpoch[5];
+
+	rastream_t streams[READAHEAD_STREAMS];
+	uint32_t streamClock;
+
+	/* Top of the scratch arena, the size of all of its blocks, the most that size ever reached, and the marks held */
+	scratchblock_t* scratch;
+	size_t scratchSize;
+	size_t scratchPeak;
+	int scratchDepth;
+
+	/* Links of the list of all threads' TLBs, which GetMemStats goes through */
+	int registered;
+	struct _tlb_t* prevThread;
+	struct _tlb_t* nextThread;
 } _tlb_t;
 
 static __thread _tlb_t vtTlb = {
-#ifdef USE_PAGECACHE
-	.pageCachePage = {0, 0, 0, 0},
+	.pageCachePage = {0, 0, 0, 0, 0},
+	.stats = {
+		.tlbHits = 0,
+		.tlbMisses = 0
+	}
+};
+
+/*
+  Statistics are kept per thread, every thread adds its TLB to the list on first use, and moves its counters over
+  to retiredStats when it exits.
+*/
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t statsKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t statsKey;
+static _tlb_t* statsThreads = NULL;
+static tlb_t retiredStats;
+static int statsTiming = 0;
+
+/*
+  Translation cache shared by all threads. Entries are protected by a sequence number, which is odd while an entry
+  is being written. Readers check it did not change while copying the entry out, and treat torn reads as misses.
+  Writers that find an entry being written by somebody else simply skip updating it.
+*/
+#ifndef SHARED_TLB_SIZE
+#define SHARED_TLB_SIZE 4096
+#endif
+
+typedef struct {
+	uint32_t seq;
+	/* Generation of the shared cache the entry was filled in, FlushTlb moves to a new one */
+	uint32_t generation;
+	uint64_t page;
+	uint64_t dirBase;
+	uint64_t translation;
+	uint32_t epoch;
+	uint32_t size;
+} sharedentry_t;
+
+static int sharedTlbEnabled = 0;
+static uint32_t sharedTlbGeneration = 1;
+static sharedentry_t sharedTlb[SHARED_TLB_SIZE];
+
+/*
+  Worker pool used to split large MemReadMul batches between multiple threads. The calling thread always processes the first slice itself.
+*/
+
+#ifndef MAX_MEM_THREADS
+#define MAX_MEM_THREADS 16
+#endif
+
+/* Minimum number of entries per thread, splitting smaller batches costs more than it gains */
+#ifndef MIN_PARALLEL_RW
+#define MIN_PARALLEL_RW 128
 #endif
-	.tlbHits = 0,
-	.tlbMisses = 0
+
+typedef struct {
+	const ProcessData* data;
+	RWInfo* info;
+	size_t num;
+	ssize_t* status;
+	ssize_t ret;
+} rwjob_t;
+
+typedef struct {
+	pthread_mutex_t busy;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+	pthread_t threads[MAX_MEM_THREADS];
+	rwjob_t jobs[MAX_MEM_THREADS];
+	size_t seenRounds[MAX_MEM_THREADS];
+	size_t threadCount;
+	size_t round;
+	size_t pending;
+	int exit;
+} rwpool_t;
+
+static rwpool_t rwPool = {
+	.busy = PTHREAD_MUTEX_INITIALIZER,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+	.threadCount = 0,
+	.round = 0,
+	.pending = 0,
+	.exit = 0
 };
 
-static const uint64_t PMASK = (~0xfull << 8) & 0xfffffffffull;
+/*
+  Revalidation service, refreshes the hot entries of the registered TLBs and of the shared cache in rounds.
+  The first service thread keeps the interval, and starts every round on the other ones in the same way the
+  RW pool does. Registered TLBs are written in place, so rounds only run while no thread has them paused.
+*/
+#ifndef MAX_REVALIDATED_TLBS
+#define MAX_REVALIDATED_TLBS 64
+#endif
 
-static size_t GetTlbIndex(uint64_t address);
-static struct timespec GetTime(void);
-static void VtUpdateCurTime(_tlb_t* tlb);
-static uint64_t VtMemReadU64(const ProcessData* data, _tlb_t* tlb, size_t idx, uint64_t address);
-static uint64_t VtCheckCachedResult(_tlb_t* tlb, uint64_t inAddress, uint64_t dirBase);
-static void VtUpdateCachedResult(_tlb_t* tlb, uint64_t inAddress, uint64_t address, uint64_t dirBase);
-static uint64_t VTranslateInternal(const ProcessData* data, _tlb_t* tlb, uint64_t dirBase, uint64_t address);
+typedef struct {
+	pthread_mutex_t busy;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+	int wakeInitialized;
+	pthread_t threads[MAX_MEM_THREADS];
+	size_t seenRounds[MAX_MEM_THREADS];
+	const ProcessData* data;
+	tlb_t* tlbs[MAX_REVALIDATED_TLBS];
+	size_t tlbCount;
+	size_t threadCount;
+	size_t intervalMS;
+	size_t round;
+	size_t pending;
+	size_t paused;
+	size_t rounds;
+	size_t changed;
+	int exit;
+} revalidation_t;
+
+static revalidation_t revalidation = {
+	.busy = PTHREAD_MUTEX_INITIALIZER,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+	.wakeInitialized = 0,
+	.tlbCount = 0,
+	.threadCount = 0,
+	.round = 0,
+	.pending = 0,
+	.paused = 0,
+	.exit = 0
+};
 
-static void FillRWInfo(const ProcessData* data, uint64_t dirBase, RWInfo* info, int* count, uint64_t local, uint64_t remote, size_t len);
-static int FillRWInfoMul(const ProcessData* data, uint64_t dirBase, RWInfo* origData, RWInfo* info, size_t count);
-static int CalculateDataCount(RWInfo* info, size_t count);
+/*
+  Cache of guest physical pages for the small reads of backends that need a syscall for every read. Pages are kept
+  in LRU order within the memory budget, and expire in the same way translations do. Writes done through this
+  library drop the pages they touch and bump writes, so that a page loaded while a write was in flight does not
+  get cached. Dropped entries go to the end of the LRU list, to be reused first.
+
+  Hits only take the lock of the stripe their bucket falls into, and mark the entry as referenced instead of moving
+  it in the LRU list. Referenced entries at the end of the list get moved back to the front once before they are
+  reused. Changes to the buckets, and to the pages linked into them, hold both the global lock and the stripe lock,
+  so either of them is enough to walk a bucket.
+*/
+#ifndef DATA_CACHE_MAX_READ
+#define DATA_CACHE_MAX_READ 256
+#endif
 
-ssize_t VMemRead(const ProcessData* data, uint64_t dirBase, uint64_t local, uint64_t remote, size_t size)
-{
-	if ((remote >> 12ull) == ((remote + size) >> 12ull))
-		return MemRead(data, local, VTranslate(data, dirBase, remote), size);
+#define DC_LOCK_STRIPES 32
+#define DC_NONE UINT32_MAX
+#define DC_INVALID_PAGE (~0ull)
 
-	int dataCount = (int)((size - 1) / 0x1000) + 2;
-	RWInfo rdataStack[MAX_BATCHED_RW];
-	RWInfo* rdata = rdataStack;
+typedef struct {
+	uint64_t page;
+	uint32_t epoch;
+	uint32_t hashNext;
+	uint32_t lruPrev;
+	uint32_t lruNext;
+	/* Loaded by readahead and not read yet */
+	int prefetched;
+	/* Hit since it was last moved in the LRU list */
+	int referenced;
+} dcentry_t;
 
-	if (dataCount > MAX_BATCHED_RW)
-		rdata = (RWInfo*)malloc(sizeof(RWInfo) * dataCount);
+typedef struct {
+	pthread_mutex_t lock;
+	size_t capacity;
+	size_t used;
+	size_t bucketMask;
+	size_t writes;
+	dcentry_t* entries;
+	uint32_t* buckets;
+	char* pages;
+	uint32_t lruHead;
+	uint32_t lruTail;
+	int stripesInitialized;
+	pthread_mutex_t stripes[DC_LOCK_STRIPES];
+} datacache_t;
+
+static datacache_t dataCache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.capacity = 0,
+	.used = 0,
+	.writes = 0,
+	.entries = NULL,
+	.buckets = NULL,
+	.pages = NULL,
+	.stripesInitialized = 0
+};
 
-	FillRWInfo(data, dirBase, rdata, &dataCount, local, remote, size);
-	ssize_t ret = MemReadMul(data, rdata, dataCount);
+/* Largest readahead batch in pages, 0 disables readahead */
+static size_t readaheadMaxPages = 0;
 
-	if (rdata != rdataStack)
-		free(rdata);
+/* Physical address bits 12 to 51 of a page table entry, the architectural maximum */
+static const uint64_t PMASK = 0x000ffffffffff000ull;
 
-	return ret;
-}
+/*
+  Bits of the address that index each level, PML5 to PT. Levels are counted from the PML4, which leaves the
+  PML5 at level -1, so that the rest of the code is the same for 4 and 5-level paging.
+*/
+static const int levelShiftsLA57[5] = {48, 39, 30, 21, 12};
+static const int* const levelShifts = levelShiftsLA57 + 1;
 
-ssize_t VMemWrite(const ProcessData* data, uint64_t dirBase, uint64_t local, uint64_t remote, size_t size)
-{
-	if ((remote >> 12ull) == ((remote + size) >> 12ull))
-		return MemWrite(data, local, VTranslate(data, dirBase, remote), size);
+/*
+  State of a single address in a VTranslateMul batch. The batch is walked one level at a time, level being the one
+  of the last entry read (-1 before the PML4E, -2 before the PML5E), and the page table entries each level needs
+  are read in one go.
+*/
+
+typedef struct {
+	uint64_t address;
+	uint64_t entry;
+	size_t index;
+	int level;
+} vtwalk_t;
 
-	int dataCount = (int)((size - 1) / 0x1000) + 2;
-	RWInfo wdataStack[MAX_BATCHED_RW];
-	RWInfo* wdata = wdataStack;
+typedef struct {
+	uint64_t entryAddress;
+	vtwalk_t* walk;
+	size_t slot;
+} vtread_t;
 
-	if (dataCount > MAX_BATCHED_RW)
-		wdata = (RWInfo*)malloc(sizeof(RWInfo) * dataCount);
+/*
+  Address space enumeration. Each thread walks its part of the tree a level at a time, reading up to ENUM_CHUNK
+  page tables with a single MemReadMul.
+*/
+#ifndef ENUM_CHUNK
+#define ENUM_CHUNK 256
+#endif
 
-	FillRWInfo(data, dirBase, wdata, &dataCount, local, remote, size);
-	ssize_t ret = MemWriteMul(data, wdata, dataCount);
+#define ENUM_THREADS 4
 
-	if (wdata != wdataStack)
-		free(wdata);
+typedef struct {
+	uint64_t table;
+	/* First virtual address mapped by the table, and the rights granted by the levels above it */
+	uint64_t base;
+	uint32_t flags;
+} enumtable_t;
 
-	return ret;
-}
+typedef struct {
+	const ProcessData* data;
+	/* Level of the entries in tables, 0 for PML4 tables */
+	int level;
+	enumtable_t* tables;
+	size_t tableCount;
+	MemRange* ranges;
+	size_t rangeCount;
+	size_t rangeCapacity;
+	int failed;
+} enumjob_t;
+
+static int VtEpochValid(const _tlb_t* tlb, uint32_t epoch);
+static int VtNegativeValid(const _tlb_t* tlb, uint32_t epoch);
+static void VtUpdateCurEpoch(_tlb_t* tlb);
+static void StartEpochTimer(void);
+static void* EpochTimer(void* arg);
+static void EpochTimerForked(void);
+static int VtMemReadU64(const ProcessData* data, _tlb_t* tlb, size_t idx, uint64_t address, uint64_t* entry);
+static int VtCheckCachedResult(_tlb_t* tlb, uint64_t inAddress, uint64_t dirBase, uint64_t* translation, int* pageSize);
+static void VtUpdateCachedResult(_tlb_t* tlb, uint64_t inAddress, uint64_t address, uint64_t dirBase, int size, uint32_t epoch, int global);
+static tlbentry_t* VtFindEntry(_tlb_t* tlb, uint64_t page, uint64_t dirBase, int size);
+static void VtUpdateNegativeResult(_tlb_t* tlb, uint64_t inAddress, uint64_t dirBase);
+static inline tlbset_t* VtGetSet(_tlb_t* tlb, uint64_t page, uint64_t dirBase, int size);
+static tlbentry_t* VtSelectEntry(_tlb_t* tlb, tlbset_t* set, uint64_t page, uint64_t dirBase, int size);
+static uint32_t VtAllowedWays(_tlb_t* tlb, uint64_t dirBase);
+static uint64_t VtCheckSharedResult(_tlb_t* tlb, uint64_t inAddress, uint64_t dirBase, int* size, uint32_t* epoch);
+static void VtUpdateSharedResult(_tlb_t* tlb, uint64_t inAddress, uint64_t address, uint64_t dirBase, int size);
+static size_t GetSharedTlbIndex(uint64_t page, uint64_t dirBase, int size);
+static uint64_t VTranslateInternal(const ProcessData* data, _tlb_t* tlb, uint64_t dirBase, uint64_t address, int* size);
+static inline uint64_t VtWalk(const ProcessData* data, _tlb_t* tlb, uint64_t dirBase, uint64_t address, int* size, const int levels);
+static int VtCheckCachedEntry(_tlb_t* tlb, uint64_t dirBase, uint64_t address, uint64_t* entry);
+static void VtUpdateCachedEntry(_tlb_t* tlb, int level, uint64_t dirBase, uint64_t address, uint64_t entry);
+static uint64_t VtFault(_tlb_t* tlb, int level, uint64_t entry);
+static uint64_t VtReadFailed(_tlb_t* tlb);
+static uint64_t VtLeafTranslation(_tlb_t* tlb, int level, uint64_t entry, uint64_t address, int* size);
+
+static void VTranslateMulInternal(const ProcessData* data, uint64_t dirBase, const uint64_t* addresses, uint64_t* out, ssize_t* faults, int* sizes, size_t n);
+static void VtWalkStep(_tlb_t* tlb, uint64_t dirBase, vtwalk_t* walk, int level, uint64_t entry, uint64_t* out, ssize_t* faults, int* sizes);
+static void VtFinishWalk(_tlb_t* tlb, uint64_t dirBase, vtwalk_t* walk, uint64_t translation, int size, uint64_t* out, ssize_t* faults, int* sizes);
+static void VtFailWalk(vtwalk_t* walk, uint64_t* out, ssize_t* faults, int* sizes);
+static int CompareWalkReads(const void* a, const void* b);
+
+static void* EnumWorker(void* arg);
+static int EnumAddRange(enumjob_t* job, uint64_t start, uint64_t size, uint64_t pageSize, uint32_t flags);
+static int EnumAddTable(enumtable_t** tables, size_t* count, size_t* capacity, enumtable_t table);
+static uint32_t EnumFlags(uint32_t flags, uint64_t entry);
+static int CompareRanges(const void* a, const void* b);
+
+static void* RWPoolWorker(void* arg);
+static void StopRWPool(void);
+
+static void* RevalidationWorker(void* arg);
+static void StopRevalidation(void);
+static size_t RevalidateSlice(size_t splitCount, size_t splitID);
+static void VtExpireWalkCaches(_tlb_t* tlb);
+
+static inline _tlb_t* VtThreadTlb(void);
+static void VtRegisterThread(_tlb_t* tlb);
+static void VtCreateStatsKey(void);
+static void VtThreadExit(void* arg);
+static inline scratchmark_t VtScratchMark(_tlb_t* tlb);
+static void* VtScratchAlloc(_tlb_t* tlb, size_t size);
+static void VtScratchRelease(_tlb_t* tlb, scratchmark_t mark);
+static void VtScratchFree(_tlb_t* tlb);
+static void AddStats(tlb_t* stats, const tlb_t* add);
+static inline uint64_t StatTimeStart(void);
+static inline void StatTimeEnd(uint64_t start, size_t* histogram);
+static uint64_t VTranslateCached(const ProcessData* data, _tlb_t* tlb, uint64_t dirBase, uint64_t address);
+static ssize_t ParallelReadMul(const ProcessData* data, RWInfo* info, size_t num, ssize_t* status);
+
+static ssize_t VtMemRead(const ProcessData* data, _tlb_t* tlb, uint64_t local, uint64_t remote, size_t size);
+static ssize_t DataCacheRead(const ProcessData* data, _tlb_t* tlb, uint64_t local, uint64_t remote, size_t size);
+static void DataCacheInvalidate(const RWInfo* info, size_t num);
+static void DataCacheFill(_tlb_t* tlb, const RWInfo* info, const ssize_t* status, size_t num, const char* buffer, size_t writes);
+static void VtReadahead(const ProcessData* data, _tlb_t* tlb, uint64_t dirBase, uint64_t address);
+static void VtReadaheadBatch(const ProcessData* data, _tlb_t* tlb, rastream_t* stream, size_t count);
+static inline size_t DataCacheHash(uint64_t page);
+static inline pthread_mutex_t* DataCacheStripe(uint64_t page);
+static uint32_t DataCacheFind(uint64_t page);
+static void DataCacheStore(uint64_t page, const char* buffer, uint32_t epoch, int prefetched);
+static uint32_t DataCacheAllocate(void);
+static void DataCacheTouch(uint32_t idx);
+static void DataCacheDrop(uint32_t idx);
+static void DataCacheUnlink(uint32_t idx);
+
+static ssize_t VMemRWMul(const ProcessData* data, uint64_t dirBase, RWInfo* info, size_t num, ssize_t* status, int write);
+static int FillRWInfo(const ProcessData* data, uint64_t dirBase, RWInfo* info, uint64_t local, uint64_t remote, size_t len, ssize_t* fault);
+static int FillRWInfoMul(const ProcessData* data, uint64_t dirBase, RWInfo* origData, RWInfo* info, size_t count, ssize_t* faults, ssize_t* counts);
+static void MergeRWStatus(ssize_t* status, size_t num, const ssize_t* rwStatus, const ssize_t* counts);
+static int CalculateDataCount(RWInfo* info, size_t count);
+static int FillRWScan(_tlb_t* tlb, uint64_t dirBase, const RWInfo* entry, RWInfo* chunks, uint64_t* phys, ssize_t* chunkFaults, size_t* chunkCount, size_t* done, int queue);
+static void FillRWChunk(const RWInfo* entry, RWInfo* chunks, uint64_t* phys, ssize_t* chunkFaults, size_t* chunkCount, size_t* done, int pageShift, uint64_t translation, ssize_t fault);
 
-uint64_t VMemReadU64(const ProcessData* data, uint64_t dirBase, uint64_t remote)
+void SetMemBackend(ProcessData* data, const MemBackend* backend)
 {
-	uint64_t dest;
-	MemRead(data, (uint64_t)&dest, VTranslate(data, dirBase, remote), sizeof(uint64_t));
-	return dest;
+	data->backend = *backend;
 }
 
-ssize_t VMemWriteU64(const ProcessData* data, uint64_t dirBase, uint64_t remote, uint64_t value)
+void SetMemLayout(ProcessData* data, const MemRegion* ram, size_t count, uint64_t lowSize, uint64_t highStart)
 {
-	return MemRead(data, (uint64_t)&value, VTranslate(data, dirBase, remote), sizeof(uint64_t));
-}
+	uint64_t address = 0;
 
-uint64_t MemReadU64(const ProcessData* data, uint64_t remote)
-{
-	uint64_t dest;
-	MemRead(data, (uint64_t)&dest, remote, sizeof(uint64_t));
-	return dest;
+	data->regionCount = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		uint64_t mapping = ram[i].mapping;
+		uint64_t size = ram[i].size;
+
+		while (size) {
+			if (address == lowSize)
+				address = highStart;
+
+			uint64_t chunk = size;
+
+			if (address < lowSize && lowSize - address < chunk)
+				chunk = lowSize - address;
+
+			MemRegion* last = data->regionCount ? data->regions + data->regionCount - 1 : NULL;
+
+			if (last && last->start + last->size == address && last->mapping + last->size == mapping)
+				last->size += chunk;
+			else if (data->regionCount < MAX_MEM_REGIONS)
+				data->regions[data->regionCount++] = (MemRegion) {
+					.start = address,
+					.size = chunk,
+					.mapping = mapping
+				};
+			else
+				return;
+
+			address += chunk;
+			mapping += chunk;
+			size -= chunk;
+		}
+	}
 }
 
-ssize_t MemWriteU64(const ProcessData* data, uint64_t remote, uint64_t value)
+ssize_t MemRead(const ProcessData* data, uint64_t local, uint64_t remote, size_t size)
 {
-	return MemRead(data, (uint64_t)&value, remote, sizeof(uint64_t));
+	_tlb_t* tlb = VtThreadTlb();
+
+	/* Reads that do not follow a translation need the current epoch to check the cached pages against */
+	if (__atomic_load_n(&dataCache.capacity, __ATOMIC_RELAXED) && !data->backend.map)
+		VtUpdateCurEpoch(tlb);
+
+	return VtMemRead(data, tlb, local, remote, size);
 }
 
-ssize_t VMemReadMul(const ProcessData* data, uint64_t dirBase, RWInfo* info, size_t num)
+/* MemRead for callers that have just translated the address, and with it loaded the current epoch */
+static ssize_t VtMemRead(const ProcessData* data, _tlb_t* tlb, uint64_t local, uint64_t remote, size_t size)
 {
-	int dataCount = CalculateDataCount(info, num);
-	RWInfo readInfoStack[MAX_BATCHED_RW];
-	RWInfo* readInfo = readInfoStack;
+	/* Backends that map the memory are faster to read directly than any cache */
+	if (__atomic_load_n(&dataCache.capacity, __ATOMIC_RELAXED) && !data->backend.map) {
+		ssize_t ret = DataCacheRead(data, tlb, local, remote, size);
 
-	if (dataCount > MAX_BATCHED_RW)
-		readInfo = (RWInfo*)malloc(sizeof(RWInfo) * dataCount);
+		if (ret)
+			return ret;
+	}
 
-	dataCount = FillRWInfoMul(data, dirBase, info, readInfo, num);
-	ssize_t ret = MemReadMul(data, readInfo, dataCount);
+	ssize_t ret = data->backend.read(data, local, remote, size);
 
-	if (readInfo != readInfoStack)
-		free(readInfo);
+	tlb->stats.backendCalls++;
+	tlb->stats.backendBytes += ret > 0 ? ret : 0;
 
 	return ret;
 }
 
-ssize_t VMemWriteMul(const ProcessData* data, uint64_t dirBase, RWInfo* info, size_t num)
+ssize_t MemWrite(const ProcessData* data, uint64_t local, uint64_t remote, size_t size)
 {
-	int dataCount = CalculateDataCount(info, num);
-	RWInfo writeInfoStack[MAX_BATCHED_RW];
-	RWInfo* writeInfo = writeInfoStack;
+	ssize_t ret = data->backend.write(data, local, remote, size);
 
-	if (dataCount > MAX_BATCHED_RW)
-			writeInfo = (RWInfo*)malloc(sizeof(RWInfo) * dataCount);
+	if (__atomic_load_n(&dataCache.capacity, __ATOMIC_RELAXED)) {
+		RWInfo info = {
+			.local = local,
+			.remote = remote,
+			.size = size
+		};
 
-	dataCount = FillRWInfoMul(data, dirBase, info, writeInfo, num);
-	ssize_t ret = MemWriteMul(data, writeInfo, dataCount);
+		DataCacheInvalidate(&info, 1);
+	}
 
-	if (writeInfo != writeInfoStack)
-		free(writeInfo);
+	tlb_t* stats = &VtThreadTlb()->stats;
+	stats->backendCalls++;
+	stats->backendBytes += ret > 0 ? ret : 0;
 
 	return ret;
 }
 
-uint64_t VTranslate(const ProcessData* data, uint64_t dirBase, uint64_t address)
+ssize_t MemReadMul(const ProcessData* data, RWInfo* info, size_t num)
 {
-	dirBase &= ~0xf;
-
-	_tlb_t* tlb = &vtTlb;
+	return MemReadMulStatus(data, info, num, NULL);
+}
 
-	uint64_t cachedVal = VtCheckCachedResult(tlb, address, dirBase);
+ssize_t MemWriteMul(const ProcessData* data, RWInfo* info, size_t num)
+{
+	return MemWriteMulStatus(data, info, num, NULL);
+}
 
-	if (cachedVal)
-		return cachedVal;
+ssize_t MemReadMulStatus(const ProcessData* data, RWInfo* info, size_t num, ssize_t* status)
+{
+	uint64_t start = StatTimeStart();
+	ssize_t ret;
 
-	cachedVal = VTranslateInternal(data, tlb, dirBase, address);
+	if (rwPool.threadCount && num >= 2 * MIN_PARALLEL_RW)
+		ret = ParallelReadMul(data, info, num, status);
+	else
+		ret = data->backend.readMul(data, info, num, status);
 
-	VtUpdateCachedResult(tlb, address, cachedVal, dirBase);
+	tlb_t* stats = &VtThreadTlb()->stats;
+	stats->backendCalls++;
+	stats->backendBytes += ret > 0 ? ret : 0;
+	StatTimeEnd(start, stats->readMulLatency);
 
-	return cachedVal;
+	return ret;
 }
 
-void SetMemCacheTime(size_t newTime)
+ssize_t MemWriteMulStatus(const ProcessData* data, RWInfo* info, size_t num, ssize_t* status)
 {
-	vtCacheTimeMS = newTime;
-}
+	ssize_t ret = data->backend.writeMul(data, info, num, status);
 
-size_t GetDefaultMemCacheTime(void)
-{
-	return VT_CACHE_TIME_MS;
+	if (__atomic_load_n(&dataCache.capacity, __ATOMIC_RELAXED))
+		DataCacheInvalidate(info, num);
+
+	tlb_t* stats = &VtThreadTlb()->stats;
+	stats->backendCalls++;
+	stats->backendBytes += ret > 0 ? ret : 0;
+
+	return ret;
 }
 
-tlb_t* GetTlb(void)
+ssize_t VMemRead(const ProcessData* data, uint64_t dirBase, uint64_t local, uint64_t remote, size_t size)
 {
-	return (tlb_t*)&vtTlb;
+	uint64_t start = StatTimeStart();
+	ssize_t ret;
+
+	_tlb_t* tlb = VtThreadTlb();
+
+	if ((remote >> 12ull) == ((remote + size) >> 12ull)) {
+		/* Only reads the page cache can serve are worth prefetching for */
+		if (size <= DATA_CACHE_MAX_READ)
+			VtReadahead(data, tlb, dirBase, remote);
+		uint64_t translated = VTranslate(data, dirBase, remote);
+		ret = translated ? VtMemRead(data, tlb, local, translated, size) : -1;
+	} else {
+		scratchmark_t mark = VtScratchMark(tlb);
+		RWInfo* rdata = (RWInfo*)VtScratchAlloc(tlb, sizeof(RWInfo) * ((size - 1) / 0x1000 + 2));
+
+		ssize_t fault;
+		int dataCount = rdata ? FillRWInfo(data, dirBase, rdata, local, remote, size, &fault) : -1;
+		ret = dataCount > 0 ? MemReadMul(data, rdata, dataCount) : -1;
+
+		VtScratchRelease(tlb, mark);
+	}
+
+	StatTimeEnd(start, tlb->stats.vmemReadLatency);
+
+	return ret;
 }
 
-void VerifyTlb(const ProcessData* data, tlb_t* tlbIn, size_t splitCount, size_t splitID)
+ssize_t VMemWrite(const ProcessData* data, uint64_t dirBase, uint64_t local, uint64_t remote, size_t size)
 {
-	splitID = splitID % splitCount;
+	if ((remote >> 12ull) == ((remote + size) >> 12ull)) {
+		uint64_t translated = VTranslate(data, dirBase, remote);
+		return translated ? MemWrite(data, local, translated, size) : -1;
+	}
 
-	_tlb_t* tlb = (_tlb_t*)tlbIn;
+	_tlb_t* tlb = VtThreadTlb();
+	scratchmark_t mark = VtScratchMark(tlb);
+	RWInfo* wdata = (RWInfo*)VtScratchAlloc(tlb, sizeof(RWInfo) * ((size - 1) / 0x1000 + 2));
 
-	size_t start = TLB_SIZE * splitID / splitCount;
-	size_t end = TLB_SIZE * (splitID + 1) / splitCount;
+	ssize_t fault;
+	int dataCount = wdata ? FillRWInfo(data, dirBase, wdata, local, remote, size, &fault) : -1;
+	ssize_t ret = dataCount > 0 ? MemWriteMul(data, wdata, dataCount) : -1;
 
-	for (size_t i = start; i < end; i++) {
-		tlbentry_t entry = tlb->entries[i];
-		tlb->entries[i] = (tlbentry_t) {
-			.page = entry.page,
-			.dirBase = entry.dirBase,
-			.translation = VTranslateInternal(data, tlb, entry.page, entry.dirBase)
-		};
-	}
+	VtScratchRelease(tlb, mark);
+
+	return ret;
+}
 
-	struct timespec time = GetTime();
+uint64_t VMemReadU64(const ProcessData* data, uint64_t dirBase, uint64_t remote)
+{
+	uint64_t dest;
+	_tlb_t* tlb = VtThreadTlb();
+	if ((remote & 0xfff) <= 0x1000 - sizeof(uint64_t))
+		VtReadahead(data, tlb, dirBase, remote);
+	VtMemRead(data, tlb, (uint64_t)&dest, VTranslate(data, dirBase, remote), sizeof(uint64_t));
+	return dest;
+}
 
-	for (size_t i = start; i < end; i++)
-		tlb->entryTimes[i] = time;
+ssize_t VMemWriteU64(const ProcessData* data, uint64_t dirBase, uint64_t remote, uint64_t value)
+{
+	return VMemWrite(data, dirBase, (uint64_t)&value, remote, sizeof(uint64_t));
 }
 
-void FlushTlb(tlb_t* tlb)
+uint64_t MemReadU64(const ProcessData* data, uint64_t remote)
 {
-	struct timespec time = {
-		.tv_nsec = 0,
-		.tv_sec = 0
-	};
+	uint64_t dest;
+	MemRead(data, (uint64_t)&dest, remote, sizeof(uint64_t));
+	return dest;
+}
 
-	for (size_t i = 0; i < TLB_SIZE; i++)
-		((_tlb_t*)tlb)->entryTimes[i] = time;
+ssize_t MemWriteU64(const ProcessData* data, uint64_t remote, uint64_t value)
+{
+	return MemWrite(data, (uint64_t)&value, remote, sizeof(uint64_t));
 }
 
-/* Static functions */
+ssize_t VMemReadMul(const ProcessData* data, uint64_t dirBase, RWInfo* info, size_t num)
+{
+	return VMemRWMul(data, dirBase, info, num, NULL, 0);
+}
 
-static size_t GetTlbIndex(uint64_t address)
+ssize_t VMemWriteMul(const ProcessData* data, uint64_t dirBase, RWInfo* info, size_t num)
 {
-	return (address >> 12l) % TLB_SIZE;
+	return VMemRWMul(data, dirBase, info, num, NULL, 1);
 }
 
-static struct timespec GetTime(void)
+ssize_t VMemReadMulStatus(const ProcessData* data, uint64_t dirBase, RWInfo* info, size_t num, ssize_t* status)
 {
-	struct timespec time;
-	clock_gettime(CLOCK_MONOTONIC_COARSE, &time);
-	return time;
+	return VMemRWMul(data, dirBase, info, num, status, 0);
 }
 
-static void VtUpdateCurTime(_tlb_t* tlb)
+ssize_t VMemWriteMulStatus(const ProcessData* data, uint64_t dirBase, RWInfo* info, size_t num, ssize_t* status)
 {
-	tlb->curTime = GetTime();
+	return VMemRWMul(data, dirBase, info, num, status, 1);
 }
 
-static uint64_t VtMemReadU64(const ProcessData* data, _tlb_t* tlb, size_t idx, uint64_t address)
+ssize_t VMemView(const ProcessData* data, uint64_t dirBase, uint64_t remote, size_t size, uint64_t buffer, MemSpan* spans, size_t* count)
 {
-#ifdef USE_PAGECACHE
-	uint64_t page = address & ~0xfff;
+	size_t maxCount = *count;
+	*count = 0;
+
+	if (!data->backend.map) {
+		if (!buffer || !maxCount || VMemRead(data, dirBase, buffer, remote, size) == -1)
+			return -1;
+		spans[0] = (MemSpan){ .local = buffer, .remote = remote, .size = size };
+		*count = 1;
+		return size;
+	}
 
-	uint64_t timeDiff = (tlb->curTime.tv_sec - tlb->pageCacheTime[idx].tv_sec) * (uint64_t)1e9 + (tlb->curTime.tv_nsec - tlb->pageCacheTime[idx].tv_nsec);
+	size_t done = 0, spanCount = 0;
 
-	if (tlb->pageCachePage[idx] != page || timeDiff >= VT_CACHE_TIME_NS) {
-		MemRead(data, (uint64_t)tlb->pageCache[idx], page, 0x1000);
-		tlb->pageCachePage[idx] = page;
-		tlb->pageCacheTime[idx] = tlb->curTime;
+	while (done < size) {
+		uint64_t addr = remote + done;
+		size_t len = 0x1000 - (addr & 0xfff);
+		if (len > size - done)
+			len = size - done;
+
+		uint64_t phys = VTranslate(data, dirBase, addr);
+		uint64_t local = phys ? data->backend.map(data, phys, len) : 0;
+
+		MemSpan* last = spanCount ? spans + spanCount - 1 : NULL;
+
+		if (last && ((!local && !last->local) || (local && last->local + last->size == local)))
+			last->size += len;
+		else if (spanCount < maxCount)
+			spans[spanCount++] = (MemSpan){ .local = local, .remote = addr, .size = len };
+		else
+			break;
+
+		done += len;
 	}
 
-	return *(uint64_t*)(void*)(tlb->pageCache[idx] + (address & 0xfff));
-#else
-	(void)tlb;
-	(void)idx;
-	return MemReadU64(data, address);
-#endif
+	*count = spanCount;
+	return done;
 }
 
-static uint64_t VtCheckCachedResult(_tlb_t* tlb, uint64_t inAddress, uint64_t dirBase)
+uint64_t VTranslate(const ProcessData* data, uint64_t dirBase, uint64_t address)
 {
-	VtUpdateCurTime(tlb);
-	size_t index = GetTlbIndex(inAddress);
-	tlbentry_t tlbEntry = tlb->entries[index];
-	struct timespec tlbEntryTime = tlb->entryTimes[index];
-	if ((tlbEntry.dirBase == dirBase) && (tlbEntry.page == (inAddress & ~0xfff))) {
-		uint64_t timeDiff = (tlb->curTime.tv_sec - tlbEntryTime.tv_sec) * (uint64_t)1e9 + (tlb->curTime.tv_nsec - tlbEntryTime.tv_nsec);
+	uint64_t start = StatTimeStart();
+	_tlb_t* tlb = VtThreadTlb();
 
-		if (timeDiff < VT_CACHE_TIME_NS) {
-			tlb->tlbHits++;
-			return tlbEntry.translation | (inAddress & 0xfff);
-		}
-	}
-	return 0;
+	uint64_t ret = VTranslateCached(data, tlb, dirBase & ~0xf, address);
+
+	StatTimeEnd(start, tlb->stats.translateLatency);
+
+	return ret;
 }
 
-static void VtUpdateCachedResult(_tlb_t* tlb, uint64_t inAddress, uint64_t address, uint64_t dirBase)
+void VTranslateMul(const ProcessData* data, uint64_t dirBase, const uint64_t* addresses, uint64_t* out, size_t n)
 {
-	size_t index = GetTlbIndex(inAddress);
-	tlb->entryTimes[index] = tlb->curTime;
-	tlb->entries[index] = (tlbentry_t) {
-		.translation = address & ~0xfff,
-		.page = inAddress & ~0xfff,
-		.dirBase = dirBase
-	};
-	tlb->tlbMisses++;
+	VTranslateMulInternal(data, dirBase, addresses, out, NULL, NULL, n);
 }
 
-static uint64_t VTranslateInternal(const ProcessData* data, _tlb_t* tlb, uint64_t dirBase, uint64_t address)
+ssize_t VMemEnumerate(const ProcessData* data, uint64_t dirBase, MemRange** ranges)
 {
-	uint64_t pageOffset = address & ~(~0ul << PAGE_OFFSET_SIZE);
-	uint64_t pte = ((address >> 12) & (0x1ffll));
-	uint64_t pt = ((address >> 21) & (0x1ffll));
-	uint64_t pd = ((address >> 30) & (0x1ffll));
-	uint64_t pdp = ((address >> 39) & (0x1ffll));
+	uint64_t root[512];
 
-	uint64_t pdpe = VtMemReadU64(data, tlb, 0, dirBase + 8 * pdp);
-	if (~pdpe & 1)
-		return 0;
+	/* The PML5, or the PML4 without LA57 */
+	int top = data->pagingLevels == 5 ? -1 : 0;
 
-	uint64_t pde = VtMemReadU64(data, tlb, 1, (pdpe & PMASK) + 8 * pd);
-	if (~pde & 1)
-		return 0;
+	dirBase &= ~0xf;
+	*ranges = NULL;
 
-	/* 1GB large page, use pde's 12-34 bits */
-	if (pde & 0x80)
-		return (pde & (~0ull << 42 >> 12)) + (address & ~(~0ull << 30));
+	if (MemRead(data, (uint64_t)root, dirBase & PMASK, sizeof(root)) == -1)
+		return -1;
 
-	uint64_t pteAddr = VtMemReadU64(data, tlb, 2, (pde & PMASK) + 8 * pt);
-	if (~pteAddr & 1)
-		return 0;
+	enumjob_t jobs[ENUM_THREADS];
+	pthread_t threads[ENUM_THREADS];
+	int started[ENUM_THREADS];
+	size_t capacities[ENUM_THREADS] = {0};
+	int failed = 0;
 
-	/* 2MB large page */
-	if (pteAddr & 0x80)
-		return (pteAddr & PMASK) + (address & ~(~0ull << 21));
+	memset(jobs, 0, sizeof(jobs));
 
-	address = VtMemReadU64(data, tlb, 3, (pteAddr & PMASK) + 8 * pte) & PMASK;
+	for (size_t i = 0; i < 512; i++) {
+		uint64_t entry = root[i];
 
-	if (!address)
-		return 0;
+		if (~entry & 1)
+			continue;
 
-	return address + pageOffset;
-}
+		size_t job = i / (512 / ENUM_THREADS);
+		int unused = 64 - 9 - levelShifts[top];
 
+		/* Upper half addresses are sign extended */
+		enumtable_t table = {
+			.table = entry & PMASK,
+			.base = (uint64_t)((int64_t)(i << levelShifts[top] << unused) >> unused),
+			.flags = EnumFlags(VMEM_WRITABLE | VMEM_USER, entry)
+		};
 
-static int CalculateDataCount(RWInfo* info, size_t count)
-{
-	int ret = 0;
+		failed |= EnumAddTable(&jobs[job].tables, &jobs[job].tableCount, capacities + job, table);
+	}
 
-	for (size_t i = 0; i < count; i++)
-		ret += 1 + ((info[i].remote + info[i].size - 1) >> 12ull) - (info[i].remote >> 12ull);
+	for (size_t i = 0; i < ENUM_THREADS; i++) {
+		jobs[i].data = data;
+		jobs[i].level = top + 1;
+		started[i] = i && jobs[i].tableCount && !failed && !pthread_create(threads + i, NULL, EnumWorker, jobs + i);
+	}
 
-	return ret;
+	for (size_t i = 0; i < ENUM_THREADS; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else if (!failed)
+			EnumWorker(jobs + i);
+	}
+
+	size_t count = 0;
+
+	for (size_t i = 0; i < ENUM_THREADS; i++) {
+		failed |= jobs[i].failed;
+		count += jobs[i].rangeCount;
+	}
+
+	MemRange* list = NULL;
+
+	if (!failed && count)
+		list = (MemRange*)malloc(sizeof(MemRange) * count);
+
+	if (count && !list)
+		failed = 1;
+
+	size_t listCount = 0;
+
+	for (size_t i = 0; i < ENUM_THREADS; i++) {
+		if (!failed && jobs[i].rangeCount)
+			memcpy(list + listCount, jobs[i].ranges, sizeof(MemRange) * jobs[i].rangeCount);
+		listCount += jobs[i].rangeCount;
+		free(jobs[i].ranges);
+		free(jobs[i].tables);
+	}
+
+	if (failed) {
+		free(list);
+		return -1;
+	}
+
+	/* Large pages get found before the small pages next to them, so the ranges have to be sorted and merged once more */
+	qsort(list, listCount, sizeof(MemRange), CompareRanges);
+
+	count = 0;
+
+	for (size_t i = 0; i < listCount; i++) {
+		MemRange* last = count ? list + count - 1 : NULL;
+
+		if (last && last->start + last->size == list[i].start && last->pageSize == list[i].pageSize && last->flags == list[i].flags)
+			last->size += list[i].size;
+		else
+			list[count++] = list[i];
+	}
+
+	*ranges = list;
+
+	return count;
 }
 
-static int FillRWInfoMul(const ProcessData* data, uint64_t dirBase, RWInfo* origData, RWInfo* info, size_t count)
+void SetMemCacheTime(size_t newTime)
 {
-	int ret = 0;
+	pthread_mutex_lock(&vtEpochLock);
+	vtCacheTimeMS = newTime;
+	__atomic_store_n(&vtEpochWindow, newTime ? VT_EPOCH_WINDOW : 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&vtNegativeWindow, newTime ? VT_NEGATIVE_WINDOW : 0, __ATOMIC_RELAXED);
+	/* Entries filled with the old timing could otherwise outlive the new cache time */
+	__atomic_add_fetch(&vtEpoch, VT_EPOCH_WINDOW, __ATOMIC_RELAXED);
+	if (vtEpochWakeInitialized)
+		pthread_cond_signal(&vtEpochWake);
+	pthread_mutex_unlock(&vtEpochLock);
+}
 
-	for (size_t i = 0; i < count; i++) {
-		int lcount = 0;
-		FillRWInfo(data, dirBase, info + ret, &lcount, origData[i].local, origData[i].remote, origData[i].size);
-		ret += lcount;
-	}
-	return ret;
+void InvalidateMemCache(void)
+{
+	__atomic_add_fetch(&vtEpoch, VT_EPOCH_WINDOW, __ATOMIC_RELAXED);
 }
 
-static void FillRWInfo(const ProcessData* data, uint64_t dirBase, RWInfo* info, int* count, uint64_t local, uint64_t remote, size_t len)
+void StopMemCacheTimer(void)
 {
-	memset(info, 0, sizeof(RWInfo) * *count);
-	info[0].local = local;
-	info[0].remote = VTranslate(data, dirBase, remote);
-	info[0].size = 0x1000 - (remote & 0xfff);
+	pthread_mutex_lock(&vtEpochLock);
 
-#ifndef NO_ASSERTS
-	assert(!((remote + info[0].size) & 0xfff));
-#endif
+	if (!vtEpochTimerStarted || vtEpochTimerStopping) {
+		pthread_mutex_unlock(&vtEpochLock);
+		return;
+	}
 
-	if (info[0].size > len)
-		info[0].size = len;
+	vtEpochTimerStopping = 1;
+	pthread_cond_signal(&vtEpochWake);
+	pthread_mutex_unlock(&vtEpochLock);
 
-	uint64_t curSize = info[0].size;
+	pthread_join(vtEpochThread, NULL);
 
-	uint64_t tlen = 0;
+	pthread_mutex_lock(&vtEpochLock);
+	vtEpochTimerStopping = 0;
+	__atomic_store_n(&vtEpochTimerStarted, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&vtEpochLock);
+}
 
-	int i = 1;
-	for (; curSize < len; curSize += 0x1000) {
-		info[i].local = local + curSize;
-		info[i].remote = VTranslate(data, dirBase, remote + curSize);
-		info[i].size = len - curSize;
-		if (info[i].size > 0x1000)
-		    info[i].size = 0x1000;
-		if (info[i].remote) {
-			tlen += info[i].size;
-			i++;
-		}
-	}
+size_t GetDefaultMemCacheTime(void)
+{
+	return VT_CACHE_TIME_MS;
+}
+
+int SetTlbReservation(uint64_t dirBase, size_t ways)
+{
+	dirBase &= ~0xfull;
+
+	pthread_mutex_lock(&tlbReservations.lock);
+
+	size_t idx = tlbReservations.count;
+	size_t reserved = 0;
+
+	for (size_t i = 0; i < tlbReservations.count; i++) {
+		if (tlbReservations.dirBases[i] == dirBase)
+			idx = i;
+		else
+			reserved += tlbReservations.ways[i];
+	}
+
+	/* At least one way stays shared, every other address space would be left without any */
+	if ((ways && idx == MAX_TLB_RESERVATIONS) || reserved + ways >= TLB_WAYS) {
+		pthread_mutex_unlock(&tlbReservations.lock);
+		return -1;
+	}
+
+	if (!ways) {
+		if (idx < tlbReservations.count) {
+			tlbReservations.count--;
+
+			for (size_t i = idx; i < tlbReservations.count; i++) {
+				tlbReservations.dirBases[i] = tlbReservations.dirBases[i + 1];
+				tlbReservations.ways[i] = tlbReservations.ways[i + 1];
+			}
+		}
+	} else {
+		if (idx == tlbReservations.count)
+			tlbReservations.count++;
+
+		tlbReservations.dirBases[idx] = dirBase;
+		tlbReservations.ways[idx] = ways;
+	}
+
+	__atomic_store_n(&tlbReservations.generation, tlbReservations.generation + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&tlbReservations.lock);
+
+	return 0;
+}
+
+void SetKernelDirBase(uint64_t dirBase)
+{
+	__atomic_store_n(&vtKernelDirBase, dirBase & ~0xfull, __ATOMIC_RELAXED);
+}
+
+void SetSharedTlb(int enabled)
+{
+	__atomic_store_n(&sharedTlbEnabled, enabled, __ATOMIC_RELAXED);
+}
+
+void SetMemPageCache(size_t budget)
+{
+	size_t capacity = budget / 0x1000;
+
+	if (capacity >= DC_NONE)
+		capacity = DC_NONE - 1;
+
+	pthread_mutex_lock(&dataCache.lock);
+
+	if (!dataCache.stripesInitialized) {
+		for (size_t i = 0; i < DC_LOCK_STRIPES; i++)
+			pthread_mutex_init(dataCache.stripes + i, NULL);
+		dataCache.stripesInitialized = 1;
+	}
+
+	/* Hits only hold their stripe, all of them keep the arrays in place for the readers */
+	for (size_t i = 0; i < DC_LOCK_STRIPES; i++)
+		pthread_mutex_lock(dataCache.stripes + i);
+
+	free(dataCache.entries);
+	free(dataCache.buckets);
+	free(dataCache.pages);
+
+	dataCache.entries = NULL;
+	dataCache.buckets = NULL;
+	dataCache.pages = NULL;
+	dataCache.used = 0;
+	dataCache.lruHead = DC_NONE;
+	dataCache.lruTail = DC_NONE;
+	/* Loads that started before the resize must not be put into the new cache */
+	__atomic_add_fetch(&dataCache.writes, 1, __ATOMIC_RELAXED);
+
+	/* Every bucket has to fall into a single stripe, whatever the mask */
+	size_t bucketCount = DC_LOCK_STRIPES;
+
+	while (bucketCount < capacity)
+		bucketCount <<= 1;
+
+	if (capacity) {
+		dataCache.entries = (dcentry_t*)malloc(sizeof(dcentry_t) * capacity);
+		dataCache.buckets = (uint32_t*)malloc(sizeof(uint32_t) * bucketCount);
+		dataCache.pages = (char*)malloc(0x1000 * capacity);
+
+		if (!dataCache.entries || !dataCache.buckets || !dataCache.pages) {
+			free(dataCache.entries);
+			free(dataCache.buckets);
+			free(dataCache.pages);
+			dataCache.entries = NULL;
+			dataCache.buckets = NULL;
+			dataCache.pages = NULL;
+			capacity = 0;
+		} else {
+			memset(dataCache.buckets, 0xff, sizeof(uint32_t) * bucketCount);
+		}
+	}
+
+	dataCache.bucketMask = bucketCount - 1;
+	/* Readers that see a capacity also see the stripes initialized */
+	__atomic_store_n(&dataCache.capacity, capacity, __ATOMIC_RELEASE);
+
+	for (size_t i = 0; i < DC_LOCK_STRIPES; i++)
+		pthread_mutex_unlock(dataCache.stripes + i);
+
+	pthread_mutex_unlock(&dataCache.lock);
+}
+
+void SetMemReadahead(size_t maxPages)
+{
+	__atomic_store_n(&readaheadMaxPages, maxPages, __ATOMIC_RELAXED);
+}
+
+void SetMemThreads(size_t count)
+{
+	if (count > MAX_MEM_THREADS)
+		count = MAX_MEM_THREADS;
+
+	pthread_mutex_lock(&rwPool.busy);
+
+	StopRWPool();
+
+	for (size_t i = 0; i + 1 < count; i++) {
+		rwPool.seenRounds[i] = rwPool.round;
+		if (pthread_create(rwPool.threads + i, NULL, RWPoolWorker, (void*)i))
+			break;
+		rwPool.threadCount++;
+	}
+
+	pthread_mutex_unlock(&rwPool.busy);
+}
+
+size_t GetMemThreads(void)
+{
+	return rwPool.threadCount + 1;
+}
+
+tlb_t* GetTlb(void)
+{
+	return &VtThreadTlb()->stats;
+}
+
+void GetMemStats(tlb_t* stats)
+{
+	pthread_mutex_lock(&statsLock);
+
+	*stats = retiredStats;
+
+	for (_tlb_t* tlb = statsThreads; tlb; tlb = tlb->nextThread)
+		AddStats(stats, &tlb->stats);
+
+	pthread_mutex_unlock(&statsLock);
+}
+
+void SetMemStatsTiming(int enabled)
+{
+	__atomic_store_n(&statsTiming, enabled, __ATOMIC_RELAXED);
+}
+
+void FreeMemScratch(void)
+{
+	VtScratchFree(&vtTlb);
+}
+
+size_t VerifyTlb(const ProcessData* data, tlb_t* tlbIn, size_t splitCount, size_t splitID)
+{
+	splitID = splitID % splitCount;
+
+	_tlb_t* tlb = (_tlb_t*)tlbIn;
+
+	/* Walks go through the caches of the calling thread, which may be a different one from the owner of the TLB */
+	_tlb_t* walker = VtThreadTlb();
+	VtUpdateCurEpoch(walker);
+	VtExpireWalkCaches(walker);
+
+	uint32_t epoch = walker->curEpoch;
+	size_t changed = 0;
+
+	size_t start = TLB_SETS * splitID / splitCount;
+	size_t end = TLB_SETS * (splitID + 1) / splitCount;
+
+	for (size_t i = start; i < end; i++) {
+		for (size_t o = 0; o < TLB_WAYS; o++) {
+			tlbentry_t* entry = tlb->sets[i].ways + o;
+
+			/* Only the hot entries are worth a walk, the rest is left to expire */
+			int valid = entry->fault ? VtNegativeValid(walker, entry->epoch) : VtEpochValid(walker, entry->epoch);
+
+			if (!entry->dirBase || (!valid && !entry->referenced))
+				continue;
+
+			int size = entry->size;
+			uint64_t translation = VTranslateInternal(data, walker, entry->dirBase, entry->page, &size);
+			ssize_t fault = translation ? 0 : walker->lastFault;
+
+			/* Nothing was learned about the page, the entry is left to expire */
+			if (fault == RW_FAILED)
+				continue;
+
+			if (!translation)
+				size = walker->lastFaultSize;
+
+			/* The page got remapped with a different size, it has to be looked up again under the new one */
+			if (size != entry->size) {
+				entry->epoch = epoch - VT_EPOCH_WINDOW - VT_NEGATIVE_WINDOW;
+				entry->referenced = 0;
+				changed++;
+				continue;
+			}
+
+			if (translation != entry->translation || fault != entry->fault)
+				changed++;
+
+			entry->translation = translation;
+			entry->fault = fault;
+			entry->global = translation && walker->lastGlobal && (int64_t)entry->page < 0;
+			entry->epoch = epoch;
+		}
+	}
+
+	return changed;
+}
+
+size_t VerifySharedTlb(const ProcessData* data, size_t splitCount, size_t splitID)
+{
+	splitID = splitID % splitCount;
+
+	_tlb_t* walker = VtThreadTlb();
+	VtUpdateCurEpoch(walker);
+	VtExpireWalkCaches(walker);
+
+	uint32_t generation = __atomic_load_n(&sharedTlbGeneration, __ATOMIC_RELAXED);
+	size_t changed = 0;
+
+	size_t start = SHARED_TLB_SIZE * splitID / splitCount;
+	size_t end = SHARED_TLB_SIZE * (splitID + 1) / splitCount;
+
+	for (size_t i = start; i < end; i++) {
+		sharedentry_t* entry = sharedTlb + i;
+
+		uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+
+		if (seq & 1)
+			continue;
+
+		uint64_t page = __atomic_load_n(&entry->page, __ATOMIC_RELAXED);
+		uint64_t dirBase = __atomic_load_n(&entry->dirBase, __ATOMIC_RELAXED);
+		uint64_t oldTranslation = __atomic_load_n(&entry->translation, __ATOMIC_RELAXED);
+		uint32_t entrySize = __atomic_load_n(&entry->size, __ATOMIC_RELAXED);
+		uint32_t entryGeneration = __atomic_load_n(&entry->generation, __ATOMIC_RELAXED);
+		uint32_t entryEpoch = __atomic_load_n(&entry->epoch, __ATOMIC_RELAXED);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		if (entryGeneration != generation || !VtEpochValid(walker, entryEpoch))
+			continue;
+
+		int size = entrySize;
+		uint64_t translation = VTranslateInternal(data, walker, dirBase, page, &size);
+
+		/* Somebody else updated the entry in the meantime, it is as fresh as it gets */
+		if (!__atomic_compare_exchange_n(&entry->seq, &seq, seq + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			continue;
+
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+
+		/* The shared cache has no negative entries, failed and resized pages get dropped */
+		if (!translation || (uint32_t)size != entrySize) {
+			__atomic_store_n(&entry->generation, generation - 1, __ATOMIC_RELAXED);
+			changed++;
+		} else {
+			__atomic_store_n(&entry->translation, translation, __ATOMIC_RELAXED);
+			__atomic_store_n(&entry->epoch, walker->curEpoch, __ATOMIC_RELAXED);
+			changed += translation != oldTranslation;
+		}
+
+		__atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+	}
+
+	return changed;
+}
+
+int SetTlbRevalidation(const ProcessData* data, size_t threads, size_t intervalMS)
+{
+	if (threads > MAX_MEM_THREADS)
+		threads = MAX_MEM_THREADS;
+
+	int ret = 0;
+
+	pthread_mutex_lock(&revalidation.busy);
+
+	StopRevalidation();
+
+	if (!revalidation.wakeInitialized) {
+		pthread_condattr_t attr;
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&revalidation.wake, &attr);
+		pthread_condattr_destroy(&attr);
+		revalidation.wakeInitialized = 1;
+	}
+
+	/* Held until all threads are up, so the first round already sees the final thread count */
+	pthread_mutex_lock(&revalidation.lock);
+
+	revalidation.data = data;
+	revalidation.intervalMS = intervalMS;
+
+	for (size_t i = 0; i < threads; i++) {
+		revalidation.seenRounds[i] = revalidation.round;
+		if (pthread_create(revalidation.threads + i, NULL, RevalidationWorker, (void*)i)) {
+			ret = -1;
+			break;
+		}
+		revalidation.threadCount++;
+	}
+
+	pthread_mutex_unlock(&revalidation.lock);
+	pthread_mutex_unlock(&revalidation.busy);
+
+	return ret;
+}
+
+int RegisterTlb(tlb_t* tlb)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&revalidation.lock);
+
+	while (revalidation.pending)
+		pthread_cond_wait(&revalidation.done, &revalidation.lock);
+
+	if (revalidation.tlbCount < MAX_REVALIDATED_TLBS) {
+		revalidation.tlbs[revalidation.tlbCount++] = tlb;
+		ret = 0;
+	}
+
+	pthread_mutex_unlock(&revalidation.lock);
+
+	return ret;
+}
+
+void UnregisterTlb(tlb_t* tlb)
+{
+	pthread_mutex_lock(&revalidation.lock);
+
+	while (revalidation.pending)
+		pthread_cond_wait(&revalidation.done, &revalidation.lock);
+
+	for (size_t i = 0; i < revalidation.tlbCount; i++) {
+		if (revalidation.tlbs[i] == tlb) {
+			revalidation.tlbs[i] = revalidation.tlbs[--revalidation.tlbCount];
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&revalidation.lock);
+}
+
+void PauseTlbRevalidation(void)
+{
+	pthread_mutex_lock(&revalidation.lock);
+
+	revalidation.paused++;
+
+	while (revalidation.pending)
+		pthread_cond_wait(&revalidation.done, &revalidation.lock);
+
+	pthread_mutex_unlock(&revalidation.lock);
+}
+
+void ResumeTlbRevalidation(void)
+{
+	pthread_mutex_lock(&revalidation.lock);
+
+	if (revalidation.paused && !--revalidation.paused && revalidation.wakeInitialized)
+		pthread_cond_broadcast(&revalidation.wake);
+
+	pthread_mutex_unlock(&revalidation.lock);
+}
+
+void GetTlbRevalidationStats(size_t* rounds, size_t* changed)
+{
+	pthread_mutex_lock(&revalidation.lock);
+	*rounds = revalidation.rounds;
+	*changed = revalidation.changed;
+	pthread_mutex_unlock(&revalidation.lock);
+}
+
+void FlushTlb(tlb_t* tlb)
+{
+	/* An epoch a full window behind the current one is never valid */
+	uint32_t epoch = __atomic_load_n(&vtEpoch, __ATOMIC_RELAXED) - VT_EPOCH_WINDOW;
+
+	for (size_t i = 0; i < TLB_SETS; i++)
+		for (size_t o = 0; o < TLB_WAYS; o++)
+			((_tlb_t*)tlb)->sets[i].ways[o].epoch = epoch;
+
+	for (size_t i = 0; i < PSC_LEVELS; i++)
+		for (size_t o = 0; o < PSC_SIZE; o++)
+			((_tlb_t*)tlb)->psc[i][o].epoch = epoch;
+
+	__atomic_add_fetch(&sharedTlbGeneration, 1, __ATOMIC_RELAXED);
+}
+
+/* Static functions */
+
+static void* RWPoolWorker(void* arg)
+{
+	size_t id = (size_t)arg;
+	rwjob_t* job = rwPool.jobs + id;
+
+	pthread_mutex_lock(&rwPool.lock);
+
+	while (1) {
+		while (rwPool.seenRounds[id] == rwPool.round && !rwPool.exit)
+			pthread_cond_wait(&rwPool.wake, &rwPool.lock);
+
+		if (rwPool.exit)
+			break;
+
+		rwPool.seenRounds[id] = rwPool.round;
+
+		if (job->num) {
+			pthread_mutex_unlock(&rwPool.lock);
+			job->ret = job->data->backend.readMul(job->data, job->info, job->num, job->status);
+			pthread_mutex_lock(&rwPool.lock);
+		}
+
+		if (!--rwPool.pending)
+			pthread_cond_signal(&rwPool.done);
+	}
+
+	pthread_mutex_unlock(&rwPool.lock);
+
+	return NULL;
+}
+
+/* Has to be called with the busy lock held */
+static void StopRWPool(void)
+{
+	pthread_mutex_lock(&rwPool.lock);
+	rwPool.exit = 1;
+	pthread_cond_broadcast(&rwPool.wake);
+	pthread_mutex_unlock(&rwPool.lock);
+
+	for (size_t i = 0; i < rwPool.threadCount; i++)
+		pthread_join(rwPool.threads[i], NULL);
+
+	rwPool.threadCount = 0;
+	rwPool.exit = 0;
+}
+
+/* The first thread waits out the interval and starts the rounds, the rest only processes their slices */
+static void* RevalidationWorker(void* arg)
+{
+	size_t id = (size_t)arg;
+
+	pthread_mutex_lock(&revalidation.lock);
+
+	while (1) {
+		if (!id) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+			uint64_t nsec = deadline.tv_nsec + revalidation.intervalMS * 1000000ull;
+			deadline.tv_sec += nsec / 1000000000ull;
+			deadline.tv_nsec = nsec % 1000000000ull;
+
+			while (!revalidation.exit && !pthread_cond_timedwait(&revalidation.wake, &revalidation.lock, &deadline))
+				;
+
+			while (revalidation.pending)
+				pthread_cond_wait(&revalidation.done, &revalidation.lock);
+
+			while (revalidation.paused && !revalidation.exit)
+				pthread_cond_wait(&revalidation.wake, &revalidation.lock);
+
+			if (revalidation.exit)
+				break;
+
+			revalidation.pending = revalidation.threadCount;
+			revalidation.round++;
+			pthread_cond_broadcast(&revalidation.wake);
+		} else {
+			while (revalidation.seenRounds[id] == revalidation.round && !revalidation.exit)
+				pthread_cond_wait(&revalidation.wake, &revalidation.lock);
+
+			/* A round that got started before the exit still has to be finished */
+			if (revalidation.seenRounds[id] == revalidation.round)
+				break;
+		}
+
+		revalidation.seenRounds[id] = revalidation.round;
+
+		pthread_mutex_unlock(&revalidation.lock);
+		size_t changed = RevalidateSlice(revalidation.threadCount, id);
+		pthread_mutex_lock(&revalidation.lock);
+
+		revalidation.changed += changed;
+
+		if (!--revalidation.pending) {
+			revalidation.rounds++;
+			pthread_cond_broadcast(&revalidation.done);
+		}
+	}
+
+	pthread_mutex_unlock(&revalidation.lock);
+
+	return NULL;
+}
+
+static void StopRevalidation(void)
+{
+	pthread_mutex_lock(&revalidation.lock);
+	revalidation.exit = 1;
+	if (revalidation.wakeInitialized)
+		pthread_cond_broadcast(&revalidation.wake);
+	pthread_mutex_unlock(&revalidation.lock);
+
+	for (size_t i = 0; i < revalidation.threadCount; i++)
+		pthread_join(revalidation.threads[i], NULL);
+
+	revalidation.threadCount = 0;
+	revalidation.pending = 0;
+	revalidation.exit = 0;
+}
+
+static size_t RevalidateSlice(size_t splitCount, size_t splitID)
+{
+	size_t changed = 0;
+
+	for (size_t i = 0; i < revalidation.tlbCount; i++)
+		changed += VerifyTlb(revalidation.data, revalidation.tlbs[i], splitCount, splitID);
+
+	if (__atomic_load_n(&sharedTlbEnabled, __ATOMIC_RELAXED))
+		changed += VerifySharedTlb(revalidation.data, splitCount, splitID);
+
+	return changed;
+}
+
+/* Makes the next walks of the thread read every level again, instead of trusting the cached upper entries */
+static void VtExpireWalkCaches(_tlb_t* tlb)
+{
+	uint32_t epoch = tlb->curEpoch - VT_EPOCH_WINDOW;
+
+	for (size_t i = 0; i < PSC_LEVELS; i++)
+		for (size_t o = 0; o < PSC_SIZE; o++)
+			tlb->psc[i][o].epoch = epoch;
+
+	for (size_t i = 0; i < sizeof(tlb->pageCacheEpoch) / sizeof(tlb->pageCacheEpoch[0]); i++)
+		tlb->pageCacheEpoch[i] = epoch;
+}
+
+static ssize_t ParallelReadMul(const ProcessData* data, RWInfo* info, size_t num, ssize_t* status)
+{
+	/* Somebody else is using the pool, doing the work ourselves is better than waiting */
+	if (pthread_mutex_trylock(&rwPool.busy))
+		return data->backend.readMul(data, info, num, status);
+
+	size_t workers = rwPool.threadCount;
+	size_t threads = num / MIN_PARALLEL_RW;
+
+	if (threads > workers + 1)
+		threads = workers + 1;
+
+	if (threads < 2) {
+		pthread_mutex_unlock(&rwPool.busy);
+		return data->backend.readMul(data, info, num, status);
+	}
+
+	pthread_mutex_lock(&rwPool.lock);
+
+	for (size_t i = 0; i < workers; i++) {
+		size_t start = num * (i + 1) / threads;
+		size_t end = num * (i + 2) / threads;
+
+		rwPool.jobs[i] = (rwjob_t) {
+			.data = data,
+			.info = info + start,
+			.num = i + 1 < threads ? end - start : 0,
+			.status = status ? status + start : NULL,
+			.ret = 0
+		};
+	}
+
+	rwPool.pending = workers;
+	rwPool.round++;
+	pthread_cond_broadcast(&rwPool.wake);
+	pthread_mutex_unlock(&rwPool.lock);
+
+	ssize_t ret = data->backend.readMul(data, info, num / threads, status);
+	size_t failed = ret == -1;
+
+	pthread_mutex_lock(&rwPool.lock);
+	while (rwPool.pending)
+		pthread_cond_wait(&rwPool.done, &rwPool.lock);
+	pthread_mutex_unlock(&rwPool.lock);
+
+	if (ret == -1)
+		ret = 0;
+
+	for (size_t i = 0; i + 1 < threads; i++) {
+		if (rwPool.jobs[i].ret == -1)
+			failed++;
+		else
+			ret += rwPool.jobs[i].ret;
+	}
+
+	pthread_mutex_unlock(&rwPool.busy);
+
+	/* Same as with a single call, fail only if nothing could be done */
+	return failed == threads ? -1 : ret;
+}
+
+static int VtEpochValid(const _tlb_t* tlb, uint32_t epoch)
+{
+	return tlb->curEpoch - epoch < __atomic_load_n(&vtEpochWindow, __ATOMIC_RELAXED);
+}
+
+static int VtNegativeValid(const _tlb_t* tlb, uint32_t epoch)
+{
+	return tlb->curEpoch - epoch < __atomic_load_n(&vtNegativeWindow, __ATOMIC_RELAXED);
+}
+
+static void VtUpdateCurEpoch(_tlb_t* tlb)
+{
+	if (!__atomic_load_n(&vtEpochTimerStarted, __ATOMIC_ACQUIRE))
+		StartEpochTimer();
+
+	tlb->curEpoch = __atomic_load_n(&vtEpoch, __ATOMIC_RELAXED);
+}
+
+static void StartEpochTimer(void)
+{
+	pthread_mutex_lock(&vtEpochLock);
+
+	if (!vtEpochTimerStarted) {
+		if (!vtEpochWakeInitialized) {
+			pthread_condattr_t attr;
+			pthread_condattr_init(&attr);
+			pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+			pthread_cond_init(&vtEpochWake, &attr);
+			pthread_condattr_destroy(&attr);
+			vtEpochWakeInitialized = 1;
+		}
+
+		static int atforkRegistered = 0;
+
+		if (!atforkRegistered)
+			atforkRegistered = !pthread_atfork(NULL, NULL, EpochTimerForked);
+
+		/* Nothing advanced the epoch while the timer was stopped, thus whatever was cached before then is too old */
+		__atomic_add_fetch(&vtEpoch, VT_EPOCH_WINDOW, __ATOMIC_RELAXED);
+
+		if (!pthread_create(&vtEpochThread, NULL, EpochTimer, NULL))
+			__atomic_store_n(&vtEpochTimerStarted, 1, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&vtEpochLock);
+}
+
+static void* EpochTimer(void* arg)
+{
+	(void)arg;
+
+	pthread_mutex_lock(&vtEpochLock);
+
+	while (!vtEpochTimerStopping) {
+		if (!vtCacheTimeMS) {
+			pthread_cond_wait(&vtEpochWake, &vtEpochLock);
+			continue;
+		}
+
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+		uint64_t nsec = deadline.tv_nsec + vtCacheTimeMS * 500000ull;
+		deadline.tv_sec += nsec / 1000000000ull;
+		deadline.tv_nsec = nsec % 1000000000ull;
+
+		if (pthread_cond_timedwait(&vtEpochWake, &vtEpochLock, &deadline))
+			__atomic_add_fetch(&vtEpoch, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&vtEpochLock);
+
+	return NULL;
+}
+
+/* The timer thread does not survive a fork, the child starts its own one when needed */
+static void EpochTimerForked(void)
+{
+	pthread_mutex_init(&vtEpochLock, NULL);
+	vtEpochWakeInitialized = 0;
+	vtEpochTimerStarted = 0;
+	vtEpochTimerStopping = 0;
+}
+
+/* Returns 0 when the table could not be read, the cached page is left alone then */
+static int VtMemReadU64(const ProcessData* data, _tlb_t* tlb, size_t idx, uint64_t address, uint64_t* entry)
+{
+	/* Levels are counted from the PML4, except for the PML5 that comes last */
+	tlb->stats.walkReads[idx < 4 ? idx + 1 : 0]++;
+
+	/* Backends that map the memory read it in place, the page copy only pays off when every read is a call */
+	if (data->backend.map)
+		return VtMemRead(data, tlb, (uint64_t)entry, address, sizeof(uint64_t)) == sizeof(uint64_t);
+
+	uint64_t page = address & ~0xfff;
+
+	if (tlb->pageCachePage[idx] != page || !VtEpochValid(tlb, tlb->pageCacheEpoch[idx])) {
+		tlb->stats.pageCacheMisses++;
+
+		/* A partial read may have clobbered the copy of the old page, it is expired as well */
+		if (VtMemRead(data, tlb, (uint64_t)tlb->pageCache[idx], page, 0x1000) != 0x1000) {
+			tlb->pageCacheEpoch[idx] = tlb->curEpoch - VT_EPOCH_WINDOW;
+			return 0;
+		}
+
+		tlb->pageCachePage[idx] = page;
+		tlb->pageCacheEpoch[idx] = tlb->curEpoch;
+	} else {
+		tlb->stats.pageCacheHits++;
+	}
+
+	*entry = *(uint64_t*)(void*)(tlb->pageCache[idx] + (address & 0xfff));
+	return 1;
+}
+
+/* Bits of the page offset for each page size class */
+static const int pageShifts[TLB_PAGE_SIZES] = {12, 21, 30};
+
+/*
+  Returns 1 on a hit, negative entries hit with a translation of 0 and restore the reason of the fault.
+  pageSize receives the size class of the entry, which for negative ones is the size of the unmapped region.
+*/
+static int VtCheckCachedResult(_tlb_t* tlb, uint64_t inAddress, uint64_t dirBase, uint64_t* translation, int* pageSize)
+{
+	VtUpdateCurEpoch(tlb);
+
+	uint64_t kernelDirBase = __atomic_load_n(&vtKernelDirBase, __ATOMIC_RELAXED);
+	int shared = kernelDirBase && (int64_t)inAddress < 0 && kernelDirBase != dirBase;
+
+	for (int size = 0; size < TLB_PAGE_SIZES; size++) {
+		uint64_t mask = ~0ull << pageShifts[size];
+		tlbentry_t* entry = VtFindEntry(tlb, inAddress & mask, dirBase, size);
+
+		if (!entry && shared) {
+			entry = VtFindEntry(tlb, inAddress & mask, kernelDirBase, size);
+
+			if (!entry || !entry->global)
+				continue;
+
+			tlb->stats.globalHits++;
+		}
+
+		if (!entry)
+			continue;
+
+		entry->referenced = 1;
+		*pageSize = size;
+
+		if (entry->fault) {
+			tlb->lastFault = entry->fault;
+			tlb->stats.negativeHits++;
+			*translation = 0;
+			return 1;
+		}
+
+		tlb->stats.tlbHits++;
+		tlb->stats.tlbSizeHits[size]++;
+		*translation = entry->translation | (inAddress & ~mask);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Returns the valid entry of the page, positive or negative, if there is one */
+static tlbentry_t* VtFindEntry(_tlb_t* tlb, uint64_t page, uint64_t dirBase, int size)
+{
+	tlbset_t* set = VtGetSet(tlb, page, dirBase, size);
+
+	for (size_t i = 0; i < TLB_WAYS; i++) {
+		tlbentry_t* entry = set->ways + i;
+
+		if (entry->page != page || entry->dirBase != dirBase || entry->size != size)
+			continue;
+
+		if (entry->fault ? VtNegativeValid(tlb, entry->epoch) : VtEpochValid(tlb, entry->epoch))
+			return entry;
+	}
+
+	return NULL;
+}
+
+static void VtUpdateCachedResult(_tlb_t* tlb, uint64_t inAddress, uint64_t address, uint64_t dirBase, int size, uint32_t epoch, int global)
+{
+	uint64_t mask = ~0ull << pageShifts[size];
+
+	global = global && (int64_t)inAddress < 0;
+
+	/* Global kernel pages go under the system dirBase, and only there */
+	if (global) {
+		uint64_t kernelDirBase = __atomic_load_n(&vtKernelDirBase, __ATOMIC_RELAXED);
+
+		if (kernelDirBase)
+			dirBase = kernelDirBase;
+	}
+
+	tlbset_t* set = VtGetSet(tlb, inAddress & mask, dirBase, size);
+	tlbentry_t* entry = VtSelectEntry(tlb, set, inAddress & mask, dirBase, size);
+
+	*entry = (tlbentry_t) {
+		.page = inAddress & mask,
+		.dirBase = dirBase,
+		.translation = address & mask,
+		.epoch = epoch,
+		.size = size,
+		.referenced = 0,
+		.fault = 0,
+		.global = global
+	};
+
+	tlb->stats.tlbSizeMisses[size]++;
+}
+
+/* Caches the failure of the last walk, for the whole page of the entry it stopped at */
+static void VtUpdateNegativeResult(_tlb_t* tlb, uint64_t inAddress, uint64_t dirBase)
+{
+	if (!__atomic_load_n(&vtNegativeWindow, __ATOMIC_RELAXED) || tlb->lastFault == RW_FAILED)
+		return;
+
+	int size = tlb->lastFaultSize;
+	uint64_t mask = ~0ull << pageShifts[size];
+	tlbset_t* set = VtGetSet(tlb, inAddress & mask, dirBase, size);
+	tlbentry_t* entry = VtSelectEntry(tlb, set, inAddress & mask, dirBase, size);
+
+	*entry = (tlbentry_t) {
+		.page = inAddress & mask,
+		.dirBase = dirBase,
+		.translation = 0,
+		.epoch = tlb->curEpoch,
+		.size = size,
+		.referenced = 0,
+		.fault = tlb->lastFault,
+		.global = 0
+	};
+
+	tlb->stats.negativeFills++;
+}
+
+/*
+  The address space is part of the index, thus processes with the same virtual layout do not compete for
+  the same sets.
+*/
+static inline tlbset_t* VtGetSet(_tlb_t* tlb, uint64_t page, uint64_t dirBase, int size)
+{
+	return tlb->sets + ((page >> pageShifts[size]) ^ (((dirBase >> 12) * 0x9e3779b97f4a7c15ull) >> 40)) % TLB_SETS;
+}
+
+static tlbentry_t* VtSelectEntry(_tlb_t* tlb, tlbset_t* set, uint64_t page, uint64_t dirBase, int size)
+{
+	/* An expired entry of the same page gets refreshed in place, so that it is not cached twice */
+	for (size_t i = 0; i < TLB_WAYS; i++)
+		if (set->ways[i].page == page && set->ways[i].dirBase == dirBase && set->ways[i].size == size)
+			return set->ways + i;
+
+	uint32_t allowed = VtAllowedWays(tlb, dirBase);
+
+	/* CLOCK replacement, entries hit since the hand last passed them get a second chance */
+	while (!(allowed & (1u << set->hand)) || set->ways[set->hand].referenced) {
+		if (allowed & (1u << set->hand))
+			set->ways[set->hand].referenced = 0;
+		set->hand = (set->hand + 1) % TLB_WAYS;
+	}
+
+	tlbentry_t* entry = set->ways + set->hand;
+	set->hand = (set->hand + 1) % TLB_WAYS;
+
+	if (entry->fault ? VtNegativeValid(tlb, entry->epoch) : VtEpochValid(tlb, entry->epoch))
+		tlb->stats.tlbEvictions++;
+
+	return entry;
+}
+
+/* Ways of a set the address space may replace, the shared ones and its own reservation */
+static uint32_t VtAllowedWays(_tlb_t* tlb, uint64_t dirBase)
+{
+	uint32_t generation = __atomic_load_n(&tlbReservations.generation, __ATOMIC_ACQUIRE);
+
+	if (__builtin_expect(generation != tlb->reservationGeneration, 0)) {
+		pthread_mutex_lock(&tlbReservations.lock);
+
+		uint32_t way = 0;
+
+		for (size_t i = 0; i < tlbReservations.count; i++) {
+			tlb->reservedDirBases[i] = tlbReservations.dirBases[i];
+			tlb->reservedWays[i] = (uint32_t)(((1ull << tlbReservations.ways[i]) - 1) << way);
+			way += tlbReservations.ways[i];
+		}
+
+		tlb->reservationCount = tlbReservations.count;
+		tlb->sharedWays = TLB_ALL_WAYS & ~(uint32_t)((1ull << way) - 1);
+		tlb->reservationGeneration = tlbReservations.generation;
+
+		pthread_mutex_unlock(&tlbReservations.lock);
+	}
+
+	for (size_t i = 0; i < tlb->reservationCount; i++)
+		if (tlb->reservedDirBases[i] == (dirBase & ~0xfull))
+			return tlb->sharedWays | tlb->reservedWays[i];
+
+	return tlb->sharedWays;
+}
+
+static size_t GetSharedTlbIndex(uint64_t page, uint64_t dirBase, int size)
+{
+	return ((page >> pageShifts[size]) ^ (dirBase >> 12) * 0x9e3779b97f4a7c15ull ^ size) % SHARED_TLB_SIZE;
+}
+
+static uint64_t VtCheckSharedResult(_tlb_t* tlb, uint64_t inAddress, uint64_t dirBase, int* size, uint32_t* epoch)
+{
+	uint32_t generation = __atomic_load_n(&sharedTlbGeneration, __ATOMIC_RELAXED);
+
+	for (int i = 0; i < TLB_PAGE_SIZES; i++) {
+		uint64_t mask = ~0ull << pageShifts[i];
+		sharedentry_t* entry = sharedTlb + GetSharedTlbIndex(inAddress & mask, dirBase, i);
+
+		uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+
+		if (seq & 1)
+			continue;
+
+		uint64_t page = __atomic_load_n(&entry->page, __ATOMIC_RELAXED);
+		uint64_t entryDirBase = __atomic_load_n(&entry->dirBase, __ATOMIC_RELAXED);
+		uint64_t translation = __atomic_load_n(&entry->translation, __ATOMIC_RELAXED);
+		uint32_t entrySize = __atomic_load_n(&entry->size, __ATOMIC_RELAXED);
+		uint32_t entryGeneration = __atomic_load_n(&entry->generation, __ATOMIC_RELAXED);
+		uint32_t entryEpoch = __atomic_load_n(&entry->epoch, __ATOMIC_RELAXED);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		if (page == (inAddress & mask) && entryDirBase == dirBase && entrySize == (uint32_t)i && entryGeneration == generation && VtEpochValid(tlb, entryEpoch)) {
+			tlb->stats.sharedHits++;
+			*size = i;
+			*epoch = entryEpoch;
+			return translation | (inAddress & ~mask);
+		}
+	}
+
+	tlb->stats.sharedMisses++;
+
+	return 0;
+}
+
+static void VtUpdateSharedResult(_tlb_t* tlb, uint64_t inAddress, uint64_t address, uint64_t dirBase, int size)
+{
+	uint64_t mask = ~0ull << pageShifts[size];
+	sharedentry_t* entry = sharedTlb + GetSharedTlbIndex(inAddress & mask, dirBase, size);
+
+	uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+
+	if (seq & 1 || !__atomic_compare_exchange_n(&entry->seq, &seq, seq + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return;
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	__atomic_store_n(&entry->page, inAddress & mask, __ATOMIC_RELAXED);
+	__atomic_store_n(&entry->dirBase, dirBase, __ATOMIC_RELAXED);
+	__atomic_store_n(&entry->translation, address & mask, __ATOMIC_RELAXED);
+	__atomic_store_n(&entry->size, (uint32_t)size, __ATOMIC_RELAXED);
+	__atomic_store_n(&entry->generation, __atomic_load_n(&sharedTlbGeneration, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	__atomic_store_n(&entry->epoch, tlb->curEpoch, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&entry->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static inline _tlb_t* VtThreadTlb(void)
+{
+	_tlb_t* tlb = &vtTlb;
+
+	if (__builtin_expect(!tlb->registered, 0))
+		VtRegisterThread(tlb);
+
+	return tlb;
+}
+
+static void VtRegisterThread(_tlb_t* tlb)
+{
+	pthread_once(&statsKeyOnce, VtCreateStatsKey);
+
+	pthread_mutex_lock(&statsLock);
+
+	tlb->prevThread = NULL;
+	tlb->nextThread = statsThreads;
+	if (statsThreads)
+		statsThreads->prevThread = tlb;
+	statsThreads = tlb;
+	tlb->registered = 1;
+
+	pthread_mutex_unlock(&statsLock);
+
+	pthread_setspecific(statsKey, tlb);
+}
+
+static void VtCreateStatsKey(void)
+{
+	pthread_key_create(&statsKey, VtThreadExit);
+}
+
+/* Thread local storage goes away with the thread, its counters are kept in retiredStats */
+static void VtThreadExit(void* arg)
+{
+	_tlb_t* tlb = (_tlb_t*)arg;
+
+	pthread_mutex_lock(&statsLock);
+
+	AddStats(&retiredStats, &tlb->stats);
+
+	if (tlb->prevThread)
+		tlb->prevThread->nextThread = tlb->nextThread;
+	else
+		statsThreads = tlb->nextThread;
+
+	if (tlb->nextThread)
+		tlb->nextThread->prevThread = tlb->prevThread;
+
+	pthread_mutex_unlock(&statsLock);
+
+	VtScratchFree(tlb);
+}
+
+static void AddStats(tlb_t* stats, const tlb_t* add)
+{
+	size_t* out = (size_t*)stats;
+	const size_t* in = (const size_t*)add;
+
+	for (size_t i = 0; i < sizeof(tlb_t) / sizeof(size_t); i++)
+		out[i] += in[i];
+}
+
+static inline scratchmark_t VtScratchMark(_tlb_t* tlb)
+{
+	tlb->scratchDepth++;
+
+	return (scratchmark_t) {
+		.block = tlb->scratch,
+		.used = tlb->scratch ? tlb->scratch->used : 0
+	};
+}
+
+static void* VtScratchAlloc(_tlb_t* tlb, size_t size)
+{
+	scratchblock_t* block = tlb->scratch;
+
+	size = SCRATCH_ALIGN(size);
+
+	if (!block || block->size - block->used < size) {
+		size_t blockSize = block ? 2 * block->size : SCRATCH_MIN_SIZE;
+
+		if (blockSize < size)
+			blockSize = size;
+
+		block = (scratchblock_t*)malloc(SCRATCH_ALIGN(sizeof(scratchblock_t)) + blockSize);
+
+		if (!block)
+			return NULL;
+
+		block->prev = tlb->scratch;
+		block->size = blockSize;
+		block->used = 0;
+		tlb->scratch = block;
+		tlb->scratchSize += blockSize;
+
+		if (tlb->scratchPeak < tlb->scratchSize)
+			tlb->scratchPeak = tlb->scratchSize;
+
+		tlb->stats.scratchAllocs++;
+		tlb->stats.scratchBytes += blockSize;
+	}
+
+	void* ret = (char*)block + SCRATCH_ALIGN(sizeof(scratchblock_t)) + block->used;
+	block->used += size;
+
+	return ret;
+}
+
+static void VtScratchRelease(_tlb_t* tlb, scratchmark_t mark)
+{
+	while (tlb->scratch != mark.block) {
+		scratchblock_t* block = tlb->scratch;
+		tlb->scratch = block->prev;
+		tlb->scratchSize -= block->size;
+		free(block);
+	}
+
+	if (mark.block)
+		mark.block->used = mark.used;
+
+	/*
+	  Only once no mark is held anymore, nothing points into the blocks. Make the next request of the same size
+	  fit into a single block then, and keep the chain if that block can not be had.
+	*/
+	if (--tlb->scratchDepth || tlb->scratchSize >= tlb->scratchPeak)
+		return;
+
+	size_t peak = tlb->scratchPeak;
+	scratchblock_t* block = (scratchblock_t*)malloc(SCRATCH_ALIGN(sizeof(scratchblock_t)) + peak);
+
+	if (!block)
+		return;
+
+	VtScratchFree(tlb);
+
+	block->prev = NULL;
+	block->size = peak;
+	block->used = 0;
+	tlb->scratch = block;
+	tlb->scratchSize = peak;
+	tlb->scratchPeak = peak;
+
+	tlb->stats.scratchAllocs++;
+	tlb->stats.scratchBytes += peak;
+}
+
+static void VtScratchFree(_tlb_t* tlb)
+{
+	while (tlb->scratch) {
+		scratchblock_t* block = tlb->scratch;
+		tlb->scratch = block->prev;
+		free(block);
+	}
+
+	tlb->scratchSize = 0;
+	tlb->scratchPeak = 0;
+}
+
+/* Returns 0 when timing is disabled, which makes StatTimeEnd skip the measurement */
+static inline uint64_t StatTimeStart(void)
+{
+	if (!__atomic_load_n(&statsTiming, __ATOMIC_RELAXED))
+		return 0;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000000ull + now.tv_nsec + 1;
+}
+
+static inline void StatTimeEnd(uint64_t start, size_t* histogram)
+{
+	if (!start)
+		return;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	histogram[GetStatBucket(now.tv_sec * 1000000000ull + now.tv_nsec + 1 - start)]++;
+}
+
+static uint64_t VTranslateCached(const ProcessData* data, _tlb_t* tlb, uint64_t dirBase, uint64_t address)
+{
+	uint64_t cachedVal;
+	int size;
+
+	if (VtCheckCachedResult(tlb, address, dirBase, &cachedVal, &size))
+		return cachedVal;
+
+	tlb->stats.tlbMisses++;
+
+	if (__atomic_load_n(&sharedTlbEnabled, __ATOMIC_RELAXED)) {
+		uint32_t epoch;
+		cachedVal = VtCheckSharedResult(tlb, address, dirBase, &size, &epoch);
+
+		if (cachedVal) {
+			VtUpdateCachedResult(tlb, address, cachedVal, dirBase, size, epoch, 0);
+			return cachedVal;
+		}
+	}
+
+	cachedVal = VTranslateInternal(data, tlb, dirBase, address, &size);
+
+	if (cachedVal) {
+		VtUpdateCachedResult(tlb, address, cachedVal, dirBase, size, tlb->curEpoch, tlb->lastGlobal);
+		if (__atomic_load_n(&sharedTlbEnabled, __ATOMIC_RELAXED))
+			VtUpdateSharedResult(tlb, address, cachedVal, dirBase, size);
+	} else {
+		VtUpdateNegativeResult(tlb, address, dirBase);
+	}
+
+	return cachedVal;
+}
+
+static uint64_t VTranslateInternal(const ProcessData* data, _tlb_t* tlb, uint64_t dirBase, uint64_t address, int* size)
+{
+	if (__builtin_expect(data->pagingLevels == 5, 0))
+		return VtWalk(data, tlb, dirBase, address, size, 5);
+
+	return VtWalk(data, tlb, dirBase, address, size, 4);
+}
+
+/* Always inlined with a constant depth, the 4-level walk does not carry any of the PML5 handling */
+static inline __attribute__((always_inline)) uint64_t VtWalk(const ProcessData* data, _tlb_t* tlb, uint64_t dirBase, uint64_t address, int* size, const int levels)
+{
+	uint64_t entry = 0;
+	int level = VtCheckCachedEntry(tlb, dirBase, address, &entry);
+
+	if (level < 0)
+		tlb->stats.pscMisses++;
+	else
+		tlb->stats.pscHits++;
+
+	/* The PML5E is not cached, the PML4E covers all the address bits above it */
+	if (levels == 5 && level < 0) {
+		if (!VtMemReadU64(data, tlb, 4, dirBase + 8 * ((address >> levelShifts[-1]) & 0x1ff), &entry))
+			return VtReadFailed(tlb);
+		if (~entry & 1)
+			return VtFault(tlb, -1, entry);
+	}
+
+	/* Walk down from below the cached entry until the PDE, or a large page, is reached */
+	while (level < PSC_LEVELS - 1 && !(level > 0 && entry & 0x80)) {
+		uint64_t table = levels == 4 && level < 0 ? dirBase : entry & PMASK;
+		level++;
+
+		if (!VtMemReadU64(data, tlb, level, table + 8 * ((address >> levelShifts[level]) & 0x1ff), &entry))
+			return VtReadFailed(tlb);
+		if (~entry & 1)
+			return VtFault(tlb, level, entry);
+
+		VtUpdateCachedEntry(tlb, level, dirBase, address, entry);
+	}
+
+	if (level == 1 || entry & 0x80)
+		return VtLeafTranslation(tlb, level, entry, address, size);
+
+	uint64_t pageEntry = 0;
+
+	if (!VtMemReadU64(data, tlb, 3, (entry & PMASK) + 8 * ((address >> 12) & 0x1ff), &pageEntry))
+		return VtReadFailed(tlb);
+
+	return VtLeafTranslation(tlb, 3, pageEntry, address, size);
+}
+
+/* Final translation out of a large page PDPTE (level 1) or PDE (level 2), or a PTE (level 3) */
+static uint64_t VtLeafTranslation(_tlb_t* tlb, int level, uint64_t entry, uint64_t address, int* size)
+{
+	/* Bit 8 is the global bit in both the large page and the page table entries, but only once they are present */
+	tlb->lastGlobal = (entry & 0x101) == 0x101;
+
+	/* 1GB large page */
+	if (level == 1) {
+		*size = TLB_PAGE_1G;
+		return (entry & PMASK & (~0ull << 30)) + (address & ~(~0ull << 30));
+	}
+
+	/* 2MB large page, bit 12 is PAT and not a part of the address */
+	if (level == 2) {
+		*size = TLB_PAGE_2M;
+		return (entry & PMASK & (~0ull << 21)) + (address & ~(~0ull << 21));
+	}
+
+	/* Transition pages (bit 11 set, prototype bit 10 clear) are not present, but still hold the data */
+	if (~entry & 1 && (entry & 0xc00) != 0x800)
+		return VtFault(tlb, level, entry);
+
+	if (!(entry & PMASK))
+		return VtFault(tlb, level, entry);
+
+	*size = TLB_PAGE_4K;
+
+	return (entry & PMASK) + (address & ~(~0ul << PAGE_OFFSET_SIZE));
+}
+
+static void VTranslateMulInternal(const ProcessData* data, uint64_t dirBase, const uint64_t* addresses, uint64_t* out, ssize_t* faults, int* sizes, size_t n)
+{
+	dirBase &= ~0xf;
+
+	_tlb_t* tlb = VtThreadTlb();
+
+	/* Level of a walk that has not read anything yet */
+	const int top = data->pagingLevels == 5 ? -2 : -1;
+
+	scratchmark_t mark = VtScratchMark(tlb);
+	vtwalk_t* walks = (vtwalk_t*)VtScratchAlloc(tlb, sizeof(vtwalk_t) * n);
+	vtread_t* reads = (vtread_t*)VtScratchAlloc(tlb, sizeof(vtread_t) * n);
+	RWInfo* info = (RWInfo*)VtScratchAlloc(tlb, sizeof(RWInfo) * n);
+	uint64_t* entries = (uint64_t*)VtScratchAlloc(tlb, sizeof(uint64_t) * n);
+	ssize_t* status = (ssize_t*)VtScratchAlloc(tlb, sizeof(ssize_t) * n);
+
+	if (!walks || !reads || !info || !entries || !status) {
+		for (size_t i = 0; i < n; i++) {
+			out[i] = 0;
+			if (faults)
+				faults[i] = RW_FAILED;
+			if (sizes)
+				sizes[i] = TLB_PAGE_4K;
+		}
+
+		VtScratchRelease(tlb, mark);
+		return;
+	}
+
+	size_t walkCount = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		uint64_t address = addresses[i];
+		uint64_t cachedVal;
+		int size;
+
+		if (faults)
+			faults[i] = 0;
+
+		if (VtCheckCachedResult(tlb, address, dirBase, &cachedVal, &size)) {
+			out[i] = cachedVal;
+			if (sizes)
+				sizes[i] = size;
+			if (!cachedVal && faults)
+				faults[i] = tlb->lastFault;
+			continue;
+		}
+
+		tlb->stats.tlbMisses++;
+
+		if (__atomic_load_n(&sharedTlbEnabled, __ATOMIC_RELAXED)) {
+			uint32_t epoch;
+			cachedVal = VtCheckSharedResult(tlb, address, dirBase, &size, &epoch);
+
+			if (cachedVal) {
+				VtUpdateCachedResult(tlb, address, cachedVal, dirBase, size, epoch, 0);
+				out[i] = cachedVal;
+				if (sizes)
+					sizes[i] = size;
+				continue;
+			}
+		}
+
+		vtwalk_t* walk = walks + walkCount++;
+		walk->address = address;
+		walk->index = i;
+		walk->level = VtCheckCachedEntry(tlb, dirBase, address, &walk->entry);
+
+		if (walk->level < 0) {
+			tlb->stats.pscMisses++;
+			walk->level = top;
+		} else {
+			tlb->stats.pscHits++;
+		}
+	}
+
+	for (int level = top + 1; level <= PSC_LEVELS && walkCount; level++) {
+		size_t readCount = 0;
+
+		for (size_t i = 0; i < walkCount; i++) {
+			vtwalk_t* walk = walks + i;
+
+			if (walk->level != level - 1)
+				continue;
+
+			/* Large pages that came straight out of the paging-structure cache */
+			if (walk->level > 0 && walk->entry & 0x80) {
+				int size;
+				uint64_t translation = VtLeafTranslation(tlb, walk->level, walk->entry, walk->address, &size);
+				VtFinishWalk(tlb, dirBase, walk, translation, size, out, faults, sizes);
+				continue;
+			}
+
+			uint64_t table = walk->level == top ? dirBase : walk->entry & PMASK;
+
+			reads[readCount++] = (vtread_t) {
+				.entryAddress = table + 8 * ((walk->address >> levelShifts[level]) & 0x1ff),
+				.walk = walk
+			};
+		}
+
+		if (!readCount)
+			continue;
+
+		/* Walks sharing a page table entry only read it once, and neighbouring entries end up next to each other */
+		qsort(reads, readCount, sizeof(vtread_t), CompareWalkReads);
+
+		size_t entryCount = 0;
+
+		for (size_t i = 0; i < readCount; i++) {
+			if (!entryCount || info[entryCount - 1].remote != reads[i].entryAddress) {
+				entries[entryCount] = 0;
+				info[entryCount] = (RWInfo) {
+					.local = (uint64_t)(entries + entryCount),
+					.remote = reads[i].entryAddress,
+					.size = sizeof(uint64_t)
+				};
+				entryCount++;
+			}
+
+			reads[i].slot = entryCount - 1;
+		}
+
+		MemReadMulStatus(data, info, entryCount, status);
+		tlb->stats.walkReads[level + 1] += entryCount;
+
+		for (size_t i = 0; i < readCount; i++) {
+			/* A table that could not be read says nothing about the page, the walk fails without being cached */
+			if (status[reads[i].slot] != sizeof(uint64_t))
+				VtFailWalk(reads[i].walk, out, faults, sizes);
+			else
+				VtWalkStep(tlb, dirBase, reads[i].walk, level, entries[reads[i].slot], out, faults, sizes);
+		}
+	}
+
+	VtScratchRelease(tlb, mark);
+}
+
+static void VtWalkStep(_tlb_t* tlb, uint64_t dirBase, vtwalk_t* walk, int level, uint64_t entry, uint64_t* out, ssize_t* faults, int* sizes)
+{
+	int size = TLB_PAGE_4K;
+	uint64_t translation;
+
+	if (level < PSC_LEVELS) {
+		if (~entry & 1) {
+			VtFinishWalk(tlb, dirBase, walk, VtFault(tlb, level, entry), size, out, faults, sizes);
+			return;
+		}
+
+		if (level >= 0)
+			VtUpdateCachedEntry(tlb, level, dirBase, walk->address, entry);
+
+		walk->entry = entry;
+		walk->level = level;
+
+		/* Anything but a large page needs the next level */
+		if (level <= 0 || ~entry & 0x80)
+			return;
+	}
+
+	translation = VtLeafTranslation(tlb, level, entry, walk->address, &size);
+	VtFinishWalk(tlb, dirBase, walk, translation, size, out, faults, sizes);
+}
+
+static void VtFinishWalk(_tlb_t* tlb, uint64_t dirBase, vtwalk_t* walk, uint64_t translation, int size, uint64_t* out, ssize_t* faults, int* sizes)
+{
+	/* Never matches any level again */
+	walk->level = PSC_LEVELS + 1;
+	out[walk->index] = translation;
+
+	if (sizes)
+		sizes[walk->index] = translation ? size : tlb->lastFaultSize;
+
+	if (translation) {
+		VtUpdateCachedResult(tlb, walk->address, translation, dirBase, size, tlb->curEpoch, tlb->lastGlobal);
+		if (__atomic_load_n(&sharedTlbEnabled, __ATOMIC_RELAXED))
+			VtUpdateSharedResult(tlb, walk->address, translation, dirBase, size);
+	} else {
+		VtUpdateNegativeResult(tlb, walk->address, dirBase);
+		if (faults)
+			faults[walk->index] = tlb->lastFault;
+	}
+}
+
+static void VtFailWalk(vtwalk_t* walk, uint64_t* out, ssize_t* faults, int* sizes)
+{
+	walk->level = PSC_LEVELS + 1;
+	out[walk->index] = 0;
+
+	if (sizes)
+		sizes[walk->index] = TLB_PAGE_4K;
+
+	if (faults)
+		faults[walk->index] = RW_FAILED;
+}
+
+static void* EnumWorker(void* arg)
+{
+	enumjob_t* job = (enumjob_t*)arg;
+
+	enumtable_t* tables = job->tables;
+	size_t tableCount = job->tableCount;
+
+	uint64_t* buffer = (uint64_t*)malloc(0x1000 * ENUM_CHUNK);
+	RWInfo info[ENUM_CHUNK];
+
+	if (!buffer) {
+		job->failed = 1;
+		return NULL;
+	}
+
+	for (int level = job->level; level < 4 && tableCount && !job->failed; level++) {
+		enumtable_t* next = NULL;
+		size_t nextCount = 0;
+		size_t nextCapacity = 0;
+
+		uint64_t pageSize = 1ull << levelShifts[level];
+
+		for (size_t chunk = 0; chunk < tableCount && !job->failed; chunk += ENUM_CHUNK) {
+			size_t count = tableCount - chunk;
+			if (count > ENUM_CHUNK)
+				count = ENUM_CHUNK;
+
+			/* Tables that can not be read stay empty */
+			memset(buffer, 0, 0x1000 * count);
+
+			for (size_t i = 0; i < count; i++)
+				info[i] = (RWInfo) {
+					.local = (uint64_t)(buffer + 512 * i),
+					.remote = tables[chunk + i].table,
+					.size = 0x1000
+				};
+
+			MemReadMul(job->data, info, count);
+
+			for (size_t i = 0; i < count; i++) {
+				enumtable_t* table = tables + chunk + i;
+				uint64_t* entries = buffer + 512 * i;
+
+				for (size_t o = 0; o < 512; o++) {
+					uint64_t entry = entries[o];
+					uint64_t address = table->base + o * pageSize;
+
+					if (level == 3) {
+						if ((~entry & 1 && (entry & 0xc00) != 0x800) || !(entry & PMASK))
+							continue;
+					} else if (~entry & 1) {
+						continue;
+					}
+
+					uint32_t flags = EnumFlags(table->flags, entry);
+
+					if (level == 3 || (level > 0 && entry & 0x80)) {
+						job->failed |= EnumAddRange(job, address, pageSize, pageSize, flags);
+					} else {
+						enumtable_t nextTable = {
+							.table = entry & PMASK,
+							.base = address,
+							.flags = flags
+						};
+
+						job->failed |= EnumAddTable(&next, &nextCount, &nextCapacity, nextTable);
+					}
+				}
+			}
+		}
+
+		if (tables != job->tables)
+			free(tables);
+
+		tables = next;
+		tableCount = nextCount;
+	}
+
+	if (tables != job->tables)
+		free(tables);
+
+	free(buffer);
+
+	return NULL;
+}
+
+/* Pages are found in order within a single thread and level, those get merged right away */
+static int EnumAddRange(enumjob_t* job, uint64_t start, uint64_t size, uint64_t pageSize, uint32_t flags)
+{
+	MemRange* last = job->rangeCount ? job->ranges + job->rangeCount - 1 : NULL;
+
+	if (last && last->start + last->size == start && last->pageSize == pageSize && last->flags == flags) {
+		last->size += size;
+		return 0;
+	}
+
+	if (job->rangeCount == job->rangeCapacity) {
+		size_t capacity = job->rangeCapacity ? job->rangeCapacity * 2 : 64;
+		MemRange* ranges = (MemRange*)realloc(job->ranges, sizeof(MemRange) * capacity);
+
+		if (!ranges)
+			return 1;
+
+		job->ranges = ranges;
+		job->rangeCapacity = capacity;
+	}
+
+	job->ranges[job->rangeCount++] = (MemRange) {
+		.start = start,
+		.size = size,
+		.pageSize = pageSize,
+		.flags = flags
+	};
+
+	return 0;
+}
+
+static int EnumAddTable(enumtable_t** tables, size_t* count, size_t* capacity, enumtable_t table)
+{
+	if (*count == *capacity) {
+		size_t newCapacity = *capacity ? *capacity * 2 : 64;
+		enumtable_t* newTables = (enumtable_t*)realloc(*tables, sizeof(enumtable_t) * newCapacity);
+
+		if (!newTables)
+			return 1;
+
+		*tables = newTables;
+		*capacity = newCapacity;
+	}
+
+	(*tables)[(*count)++] = table;
+
+	return 0;
+}
+
+/* A page is writable and user accessible only if every level allows it, while NX on any level applies to it */
+static uint32_t EnumFlags(uint32_t flags, uint64_t entry)
+{
+	if (~entry & 2)
+		flags &= ~VMEM_WRITABLE;
+	if (~entry & 4)
+		flags &= ~VMEM_USER;
+	if (entry >> 63)
+		flags |= VMEM_NX;
+	return flags;
+}
+
+static int CompareRanges(const void* a, const void* b)
+{
+	uint64_t first = ((const MemRange*)a)->start;
+	uint64_t second = ((const MemRange*)b)->start;
+	return (first > second) - (first < second);
+}
+
+static int CompareWalkReads(const void* a, const void* b)
+{
+	uint64_t first = ((const vtread_t*)a)->entryAddress;
+	uint64_t second = ((const vtread_t*)b)->entryAddress;
+	return (first > second) - (first < second);
+}
+
+/* Returns the lowest level there is a valid cached entry for, -1 if there is none */
+static int VtCheckCachedEntry(_tlb_t* tlb, uint64_t dirBase, uint64_t address, uint64_t* entry)
+{
+	for (int level = PSC_LEVELS - 1; level >= 0; level--) {
+		uint64_t prefix = address >> levelShifts[level];
+		pscentry_t* cached = tlb->psc[level] + prefix % PSC_SIZE;
+
+		if (cached->prefix != prefix || cached->dirBase != dirBase)
+			continue;
+
+		if (VtEpochValid(tlb, cached->epoch)) {
+			*entry = cached->entry;
+			return level;
+		}
+	}
+
+	return -1;
+}
+
+static void VtUpdateCachedEntry(_tlb_t* tlb, int level, uint64_t dirBase, uint64_t address, uint64_t entry)
+{
+	uint64_t prefix = address >> levelShifts[level];
+
+	tlb->psc[level][prefix % PSC_SIZE] = (pscentry_t) {
+		.prefix = prefix,
+		.dirBase = dirBase,
+		.entry = entry,
+		.epoch = tlb->curEpoch
+	};
+}
+
+/* Non-present entries that are not empty are used by the guest to keep track of pages that are swapped out */
+static uint64_t VtFault(_tlb_t* tlb, int level, uint64_t entry)
+{
+	tlb->lastFault = entry ? RW_PAGED_OUT : RW_UNMAPPED;
+	/* Everything above the PDE fails a whole 1GB page at least */
+	tlb->lastFaultSize = level > 2 ? TLB_PAGE_4K : level == 2 ? TLB_PAGE_2M : TLB_PAGE_1G;
+	return 0;
+}
+
+/* A table that could not be read says nothing about the mapping, the failure is not cached */
+static uint64_t VtReadFailed(_tlb_t* tlb)
+{
+	tlb->lastFault = RW_FAILED;
+	tlb->lastFaultSize = TLB_PAGE_4K;
+	return 0;
+}
+
+/* Returns the number of bytes read, or 0 when the read has to go to the backend instead */
+static ssize_t DataCacheRead(const ProcessData* data, _tlb_t* tlb, uint64_t local, uint64_t remote, size_t size)
+{
+	uint64_t page = remote & ~0xfffull;
+	size_t offset = remote & 0xfff;
+
+	if (!size || size > DATA_CACHE_MAX_READ || offset + size > 0x1000)
+		return 0;
+
+	if (!__atomic_load_n(&dataCache.capacity, __ATOMIC_ACQUIRE))
+		return 0;
+
+	pthread_mutex_t* stripe = DataCacheStripe(page);
+
+	pthread_mutex_lock(stripe);
+
+	if (!__atomic_load_n(&dataCache.capacity, __ATOMIC_RELAXED)) {
+		pthread_mutex_unlock(stripe);
+		return 0;
+	}
+
+	uint32_t idx = DataCacheFind(page);
+
+	if (idx != DC_NONE && VtEpochValid(tlb, dataCache.entries[idx].epoch)) {
+		dcentry_t* entry = dataCache.entries + idx;
+
+		memcpy((void*)local, dataCache.pages + 0x1000 * (size_t)idx + offset, size);
+
+		if (!__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED))
+			__atomic_store_n(&entry->referenced, 1, __ATOMIC_RELAXED);
+
+		if (entry->prefetched) {
+			entry->prefetched = 0;
+			tlb->stats.readaheadHits++;
+		}
+
+		pthread_mutex_unlock(stripe);
+		tlb->stats.dataCacheHits++;
+		return size;
+	}
+
+	pthread_mutex_unlock(stripe);
+
+	size_t writes = __atomic_load_n(&dataCache.writes, __ATOMIC_ACQUIRE);
+
+	/* The page is loaded without holding the lock, a syscall would stall every other reader */
+	char buffer[0x1000];
+	ssize_t ret = data->backend.read(data, (uint64_t)buffer, page, 0x1000);
+
+	tlb->stats.dataCacheMisses++;
+	tlb->stats.backendCalls++;
+	tlb->stats.backendBytes += ret > 0 ? ret : 0;
+
+	if (ret != 0x1000)
+		return 0;
+
+	memcpy((void*)local, buffer + offset, size);
+
+	pthread_mutex_lock(&dataCache.lock);
+
+	if (dataCache.writes == writes && dataCache.capacity)
+		DataCacheStore(page, buffer, tlb->curEpoch, 0);
+
+	pthread_mutex_unlock(&dataCache.lock);
+
+	return size;
+}
+
+static void DataCacheInvalidate(const RWInfo* info, size_t num)
+{
+	pthread_mutex_lock(&dataCache.lock);
+
+	__atomic_add_fetch(&dataCache.writes, 1, __ATOMIC_RELEASE);
+
+	for (size_t i = 0; i < num && dataCache.used; i++) {
+		if (!info[i].size)
+			continue;
+
+		uint64_t first = info[i].remote >> 12;
+		uint64_t last = (info[i].remote + info[i].size - 1) >> 12;
+
+		/* Large writes are cheaper to check against every cached page than the other way around */
+		if (last - first >= dataCache.used) {
+			for (uint32_t o = 0; o < dataCache.used; o++) {
+				uint64_t page = dataCache.entries[o].page;
+
+				if (page != DC_INVALID_PAGE && page >> 12 >= first && page >> 12 <= last)
+					DataCacheDrop(o);
+			}
+		} else {
+			for (uint64_t page = first; page <= last; page++) {
+				uint32_t idx = DataCacheFind(page << 12);
+
+				if (idx != DC_NONE)
+					DataCacheDrop(idx);
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&dataCache.lock);
+}
+
+/* Puts the pages of a readahead batch into the cache, unless a write happened since writes was taken */
+static void DataCacheFill(_tlb_t* tlb, const RWInfo* info, const ssize_t* status, size_t num, const char* buffer, size_t writes)
+{
+	pthread_mutex_lock(&dataCache.lock);
+
+	if (dataCache.writes == writes && dataCache.capacity) {
+		for (size_t i = 0; i < num; i++) {
+			if (status[i] == 0x1000)
+				DataCacheStore(info[i].remote, buffer + 0x1000 * i, tlb->curEpoch, 1);
+		}
+	}
+
+	pthread_mutex_unlock(&dataCache.lock);
+}
+
+static void VtReadahead(const ProcessData* data, _tlb_t* tlb, uint64_t dirBase, uint64_t address)
+{
+	size_t maxPages = __atomic_load_n(&readaheadMaxPages, __ATOMIC_RELAXED);
+	size_t capacity = __atomic_load_n(&dataCache.capacity, __ATOMIC_RELAXED);
+
+	if (!maxPages || !capacity || data->backend.map)
+		return;
+
+	/* Batches must not push each other, or the pages being read, out of the cache */
+	if (maxPages > capacity / 4)
+		maxPages = capacity / 4;
+
+	if (maxPages < READAHEAD_MIN_WINDOW)
+		return;
+
+	dirBase &= ~0xf;
+
+	uint64_t page = address >> 12;
+	rastream_t* stream = NULL;
+	rastream_t* victim = tlb->streams;
+
+	for (size_t i = 0; i < READAHEAD_STREAMS; i++) {
+		rastream_t* cur = tlb->streams + i;
+
+		if (cur->window && cur->dirBase == dirBase && page >= cur->lastPage && page - cur->lastPage <= READAHEAD_MAX_STRIDE) {
+			stream = cur;
+			break;
+		}
+
+		if (cur->lastUse < victim->lastUse)
+			victim = cur;
+	}
+
+	tlb->streamClock++;
+
+	if (!stream) {
+		*victim = (rastream_t) {
+			.dirBase = dirBase,
+			.lastPage = page,
+			.window = READAHEAD_MIN_WINDOW,
+			.lastUse = tlb->streamClock
+		};
+		return;
+	}
+
+	stream->lastUse = tlb->streamClock;
+
+	/* Reads within the same page do not move the stream */
+	if (page == stream->lastPage)
+		return;
+
+	uint64_t stride = page - stream->lastPage;
+	stream->lastPage = page;
+
+	if (stride != stream->stride) {
+		stream->stride = stride;
+		stream->next = 0;
+		stream->lastBatch = 0;
+		stream->window = READAHEAD_MIN_WINDOW;
+		return;
+	}
+
+	if (stream->next <= page)
+		stream->next = page + stride;
+	else if ((stream->next - page) / stride > stream->lastBatch / 2)
+		return;
+
+	VtReadaheadBatch(data, tlb, stream, stream->window < maxPages ? stream->window : maxPages);
+
+	stream->window = 2 * stream->window < maxPages ? 2 * stream->window : maxPages;
+}
+
+/* Loads count pages of the stream, starting at its next page, with a single backend call */
+static void VtReadaheadBatch(const ProcessData* data, _tlb_t* tlb, rastream_t* stream, size_t count)
+{
+	scratchmark_t mark = VtScratchMark(tlb);
+	uint64_t* addresses = (uint64_t*)VtScratchAlloc(tlb, sizeof(uint64_t) * count);
+	RWInfo* info = (RWInfo*)VtScratchAlloc(tlb, sizeof(RWInfo) * count);
+	ssize_t* status = (ssize_t*)VtScratchAlloc(tlb, sizeof(ssize_t) * count);
+	char* buffer = (char*)VtScratchAlloc(tlb, 0x1000 * count);
+
+	if (!addresses || !info || !status || !buffer) {
+		VtScratchRelease(tlb, mark);
+		return;
+	}
+
+	for (size_t i = 0; i < count; i++)
+		addresses[i] = (stream->next + i * stream->stride) << 12;
+
+	VTranslateMulInternal(data, stream->dirBase, addresses, addresses, NULL, NULL, count);
+
+	size_t num = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		if (!addresses[i])
+			continue;
+
+		info[num] = (RWInfo) {
+			.local = (uint64_t)(buffer + 0x1000 * num),
+			.remote = addresses[i] & ~0xfffull,
+			.size = 0x1000
+		};
+
+		num++;
+	}
+
+	stream->next += count * stream->stride;
+	stream->lastBatch = count;
+
+	if (num) {
+		size_t writes = __atomic_load_n(&dataCache.writes, __ATOMIC_ACQUIRE);
+
+		MemReadMulStatus(data, info, num, status);
+		DataCacheFill(tlb, info, status, num, buffer, writes);
+
+		tlb->stats.readaheadBatches++;
+		tlb->stats.readaheadPages += num;
+	}
+
+	VtScratchRelease(tlb, mark);
+}
+
+static inline size_t DataCacheHash(uint64_t page)
+{
+	return (size_t)(((page >> 12) * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+/* There are at least as many buckets as stripes, the bits that pick the stripe pick the bucket as well */
+static inline pthread_mutex_t* DataCacheStripe(uint64_t page)
+{
+	return dataCache.stripes + (DataCacheHash(page) & (DC_LOCK_STRIPES - 1));
+}
+
+static uint32_t DataCacheFind(uint64_t page)
+{
+	uint32_t idx = dataCache.buckets[DataCacheHash(page) & dataCache.bucketMask];
+
+	while (idx != DC_NONE && dataCache.entries[idx].page != page)
+		idx = dataCache.entries[idx].hashNext;
+
+	return idx;
+}
+
+/* Copies the page into the cache, linking it in after the copy so that hits never see it half written */
+static void DataCacheStore(uint64_t page, const char* buffer, uint32_t epoch, int prefetched)
+{
+	uint32_t idx = DataCacheFind(page);
+	int insert = idx == DC_NONE;
+
+	if (insert)
+		idx = DataCacheAllocate();
+	else
+		DataCacheTouch(idx);
+
+	dcentry_t* entry = dataCache.entries + idx;
+	pthread_mutex_t* stripe = DataCacheStripe(page);
+
+	pthread_mutex_lock(stripe);
+
+	memcpy(dataCache.pages + 0x1000 * (size_t)idx, buffer, 0x1000);
+	entry->epoch = epoch;
+	entry->prefetched = prefetched;
+
+	if (insert) {
+		size_t bucket = DataCacheHash(page) & dataCache.bucketMask;
+
+		entry->page = page;
+		entry->hashNext = dataCache.buckets[bucket];
+		dataCache.buckets[bucket] = idx;
+	}
+
+	pthread_mutex_unlock(stripe);
+}
+
+/*
+  Takes a free entry while there are any, and the least recently used one after that. The entry is put at the
+  front of the LRU list, but not into a bucket.
+*/
+static uint32_t DataCacheAllocate(void)
+{
+	uint32_t idx;
+
+	if (dataCache.used < dataCache.capacity) {
+		idx = (uint32_t)dataCache.used++;
+	} else {
+		/* Referenced entries get another round, the bound keeps hits that keep coming from stalling the loop */
+		for (size_t i = 0; i < dataCache.capacity; i++) {
+			if (!__atomic_exchange_n(&dataCache.entries[dataCache.lruTail].referenced, 0, __ATOMIC_RELAXED))
+				break;
+
+			DataCacheTouch(dataCache.lruTail);
+		}
+
+		idx = dataCache.lruTail;
+
+		if (dataCache.entries[idx].page != DC_INVALID_PAGE)
+			DataCacheDrop(idx);
+
+		DataCacheUnlink(idx);
+	}
+
+	dcentry_t* entry = dataCache.entries + idx;
+
+	__atomic_store_n(&entry->referenced, 0, __ATOMIC_RELAXED);
+	entry->lruPrev = DC_NONE;
+	entry->lruNext = dataCache.lruHead;
+
+	if (dataCache.lruHead != DC_NONE)
+		dataCache.entries[dataCache.lruHead].lruPrev = idx;
+	else
+		dataCache.lruTail = idx;
+
+	dataCache.lruHead = idx;
+
+	return idx;
+}
+
+static void DataCacheTouch(uint32_t idx)
+{
+	if (dataCache.lruHead == idx)
+		return;
+
+	DataCacheUnlink(idx);
+
+	dcentry_t* entry = dataCache.entries + idx;
+	entry->lruPrev = DC_NONE;
+	entry->lruNext = dataCache.lruHead;
+	dataCache.entries[dataCache.lruHead].lruPrev = idx;
+	dataCache.lruHead = idx;
+}
+
+/* Removes the page from the hash table, and moves the entry to the end of the LRU list */
+static void DataCacheDrop(uint32_t idx)
+{
+	dcentry_t* entry = dataCache.entries + idx;
+	pthread_mutex_t* stripe = DataCacheStripe(entry->page);
+	uint32_t* link = dataCache.buckets + (DataCacheHash(entry->page) & dataCache.bucketMask);
+
+	pthread_mutex_lock(stripe);
+
+	while (*link != idx)
+		link = &dataCache.entries[*link].hashNext;
+
+	*link = entry->hashNext;
+	entry->page = DC_INVALID_PAGE;
+
+	pthread_mutex_unlock(stripe);
+
+	__atomic_store_n(&entry->referenced, 0, __ATOMIC_RELAXED);
+
+	if (dataCache.lruTail == idx)
+		return;
+
+	DataCacheUnlink(idx);
+
+	entry->lruNext = DC_NONE;
+	entry->lruPrev = dataCache.lruTail;
+	dataCache.entries[dataCache.lruTail].lruNext = idx;
+	dataCache.lruTail = idx;
+}
+
+static void DataCacheUnlink(uint32_t idx)
+{
+	dcentry_t* entry = dataCache.entries + idx;
+
+	if (entry->lruPrev != DC_NONE)
+		dataCache.entries[entry->lruPrev].lruNext = entry->lruNext;
+	else
+		dataCache.lruHead = entry->lruNext;
+
+	if (entry->lruNext != DC_NONE)
+		dataCache.entries[entry->lruNext].lruPrev = entry->lruPrev;
+	else
+		dataCache.lruTail = entry->lruPrev;
+}
+
+static ssize_t VMemRWMul(const ProcessData* data, uint64_t dirBase, RWInfo* info, size_t num, ssize_t* status, int write)
+{
+	int dataCount = CalculateDataCount(info, num);
+	_tlb_t* tlb = VtThreadTlb();
+	scratchmark_t mark = VtScratchMark(tlb);
+	RWInfo* rwInfo = (RWInfo*)VtScratchAlloc(tlb, sizeof(RWInfo) * dataCount);
+	ssize_t* rwStatus = NULL;
+
+	/* Results of the individual chunks, followed by the number of chunks each entry got split into */
+	if (status)
+		rwStatus = (ssize_t*)VtScratchAlloc(tlb, sizeof(ssize_t) * (dataCount + num));
+
+	ssize_t* counts = rwStatus ? rwStatus + dataCount : NULL;
+
+	dataCount = rwInfo && (rwStatus || !status) ? FillRWInfoMul(data, dirBase, info, rwInfo, num, status, counts) : -1;
+
+	ssize_t ret = -1;
+
+	if (dataCount < 0) {
+		for (size_t i = 0; status && i < num; i++)
+			status[i] = RW_FAILED;
+	} else {
+		if (write)
+			ret = MemWriteMulStatus(data, rwInfo, dataCount, rwStatus);
+		else
+			ret = MemReadMulStatus(data, rwInfo, dataCount, rwStatus);
+
+		if (status)
+			MergeRWStatus(status, num, rwStatus, counts);
+	}
+
+	VtScratchRelease(tlb, mark);
+
+	return ret;
+}
+
+
+static int CalculateDataCount(RWInfo* info, size_t count)
+{
+	int ret = 0;
+
+	for (size_t i = 0; i < count; i++)
+		ret += 1 + ((info[i].remote + info[i].size - 1) >> 12ull) - (info[i].remote >> 12ull);
+
+	return ret;
+}
+
+/*
+  Entries are split at the boundaries of the pages they actually cross, as found in the TLB or by the walker, and
+  physically contiguous neighbours get merged, thus a range inside of a large page ends up as a single chunk.
+  Every entry is scanned through the TLB until the first miss, and the missed pages of all entries are probed
+  in one batch to find out their size. The scan then goes on from the end of the probed page, and whatever
+  still misses gets split into 4KB pages, which are all translated together in a second batch.
+  Chunks without a valid translation are left out. Translation faults are written to faults, and the number of
+  chunks of every entry to counts, when those are set.
+*/
+static int FillRWInfoMul(const ProcessData* data, uint64_t dirBase, RWInfo* origData, RWInfo* info, size_t count, ssize_t* faults, ssize_t* counts)
+{
+	dirBase &= ~0xf;
+
+	_tlb_t* tlb = VtThreadTlb();
+
+	/* An entry never gets more chunks than the pages it touches, and it gets that many slots in info */
+	size_t slotCount = CalculateDataCount(origData, count);
+
+	scratchmark_t mark = VtScratchMark(tlb);
+	void* scratch = VtScratchAlloc(tlb, (sizeof(size_t) * 3 + sizeof(uint64_t) + sizeof(ssize_t) + sizeof(size_t) + sizeof(int)) * count
+		+ (sizeof(uint64_t) * 2 + sizeof(ssize_t) * 2 + sizeof(size_t)) * slotCount);
+
+	if (!scratch) {
+		VtScratchRelease(tlb, mark);
+		return -1;
+	}
+
+	/* Per entry state */
+	size_t* firstSlot = (size_t*)scratch;
+	size_t* chunkCount = firstSlot + count;
+	size_t* done = chunkCount + count;
+	/* The probe batch, one page for every entry at most */
+	uint64_t* probeAddresses = (uint64_t*)(done + count);
+	ssize_t* probeFaults = (ssize_t*)(probeAddresses + count);
+	size_t* probeEntries = (size_t*)(probeFaults + count);
+	/* Per slot state, phys is 0 for chunks that failed, or are still waiting for the second batch if they have no fault */
+	uint64_t* phys = (uint64_t*)(probeEntries + count);
+	ssize_t* chunkFaults = (ssize_t*)(phys + slotCount);
+	/* The second batch, one page for every slot at most */
+	uint64_t* pendingAddresses = (uint64_t*)(chunkFaults + slotCount);
+	ssize_t* pendingFaults = (ssize_t*)(pendingAddresses + slotCount);
+	size_t* pendingSlots = (size_t*)(pendingFaults + slotCount);
+	int* probeSizes = (int*)(pendingSlots + slotCount);
+
+	size_t probeCount = 0;
+	size_t slot = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		firstSlot[i] = slot;
+		chunkCount[i] = 0;
+		done[i] = 0;
+
+		if (!origData[i].size)
+			continue;
+
+		slot += 1 + ((origData[i].remote + origData[i].size - 1) >> 12) - (origData[i].remote >> 12);
+
+		if (FillRWScan(tlb, dirBase, origData + i, info + firstSlot[i], phys + firstSlot[i], chunkFaults + firstSlot[i], chunkCount + i, done + i, 0)) {
+			probeEntries[probeCount] = i;
+			probeAddresses[probeCount++] = origData[i].remote + done[i];
+		}
+	}
+
+	size_t pendingCount = 0;
+
+	if (probeCount) {
+		VTranslateMulInternal(data, dirBase, probeAddresses, probeAddresses, probeFaults, probeSizes, probeCount);
+
+		for (size_t i = 0; i < probeCount; i++) {
+			size_t entry = probeEntries[i];
+			size_t first = firstSlot[entry];
+			size_t firstPending = chunkCount[entry];
+
+			FillRWChunk(origData + entry, info + first, phys + first, chunkFaults + first, chunkCount + entry, done + entry,
+				pageShifts[probeSizes[i]], probeAddresses[i], probeFaults[i]);
+
+			/* The probed chunk is resolved already, only the ones after it can be waiting */
+			firstPending++;
+
+			FillRWScan(tlb, dirBase, origData + entry, info + first, phys + first, chunkFaults + first, chunkCount + entry, done + entry, 1);
+
+			for (size_t o = firstPending; o < chunkCount[entry]; o++) {
+				if (phys[first + o] || chunkFaults[first + o])
+					continue;
+
+				pendingSlots[pendingCount] = first + o;
+				pendingAddresses[pendingCount++] = info[first + o].remote;
+			}
+		}
+	}
+
+	if (pendingCount) {
+		VTranslateMulInternal(data, dirBase, pendingAddresses, pendingAddresses, pendingFaults, NULL, pendingCount);
+
+		for (size_t i = 0; i < pendingCount; i++) {
+			phys[pendingSlots[i]] = pendingAddresses[i];
+			chunkFaults[pendingSlots[i]] = pendingAddresses[i] ? 0 : pendingFaults[i];
+		}
+	}
+
+	/* Entries only ever move towards the start, thus the chunks can be compacted in place */
+	int ret = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		ssize_t fault = 0;
+		int lcount = 0;
+
+		for (size_t o = firstSlot[i]; o < firstSlot[i] + chunkCount[i]; o++) {
+			if (!phys[o]) {
+				if (!fault)
+					fault = chunkFaults[o];
+				continue;
+			}
+
+			RWInfo* last = lcount ? info + ret - 1 : NULL;
+
+			/*
+			  Both sides have to be contiguous, a chunk that failed to translate leaves a gap in the local buffer.
+			  Chunks are not merged across the end of a RAM region, a failing part would take the rest with it.
+			*/
+			if (last && last->local + last->size == info[o].local && last->remote + last->size == phys[o]
+				&& GetMemMapping(data, last->remote, last->size + info[o].size)) {
+				last->size += info[o].size;
+				continue;
+			}
+
+			info[ret] = (RWInfo) {
+				.local = info[o].local,
+				.remote = phys[o],
+				.size = info[o].size
+			};
+
+			ret++;
+			lcount++;
+		}
+
+		if (faults) {
+			faults[i] = fault;
+			counts[i] = lcount;
+		}
+	}
+
+	VtScratchRelease(tlb, mark);
+
+	return ret;
+}
+
+/*
+  Continues splitting an entry into chunks, from the offset done, for as long as its pages are in the TLB.
+  Returns 1 when it stops at a page that is not cached. With queue set, such pages become 4KB chunks waiting
+  for a translation instead, and it always returns 0.
+*/
+static int FillRWScan(_tlb_t* tlb, uint64_t dirBase, const RWInfo* entry, RWInfo* chunks, uint64_t* phys, ssize_t* chunkFaults, size_t* chunkCount, size_t* done, int queue)
+{
+	while (*done < entry->size) {
+		uint64_t address = entry->remote + *done;
+		uint64_t translation;
+		int size;
+
+		if (VtCheckCachedResult(tlb, address, dirBase, &translation, &size)) {
+			FillRWChunk(entry, chunks, phys, chunkFaults, chunkCount, done, pageShifts[size], translation, translation ? 0 : tlb->lastFault);
+		} else if (queue) {
+			FillRWChunk(entry, chunks, phys, chunkFaults, chunkCount, done, 12, 0, 0);
+		} else {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Adds the chunk of an entry from the offset done, up to the end of the page of the given size */
+static void FillRWChunk(const RWInfo* entry, RWInfo* chunks, uint64_t* phys, ssize_t* chunkFaults, size_t* chunkCount, size_t* done, int pageShift, uint64_t translation, ssize_t fault)
+{
+	uint64_t address = entry->remote + *done;
+	size_t size = (1ull << pageShift) - (address & ((1ull << pageShift) - 1));
+
+	if (size > entry->size - *done)
+		size = entry->size - *done;
+
+	chunks[*chunkCount] = (RWInfo) {
+		.local = entry->local + *done,
+		.remote = address,
+		.size = size
+	};
+
+	phys[*chunkCount] = translation;
+	chunkFaults[*chunkCount] = fault;
+
+	(*chunkCount)++;
+	*done += size;
+}
+
+/* Entries get the bytes moved by all of their pages, or the first error, translation faults being reported first */
+static void MergeRWStatus(ssize_t* status, size_t num, const ssize_t* rwStatus, const ssize_t* counts)
+{
+	for (size_t i = 0; i < num; i++) {
+		ssize_t moved = 0;
+
+		for (ssize_t o = 0; o < counts[i]; o++) {
+			if (rwStatus[o] < 0) {
+				moved = rwStatus[o];
+				break;
+			}
+			moved += rwStatus[o];
+		}
+
+		if (!status[i])
+			status[i] = moved;
+
+		rwStatus += counts[i];
+	}
+}
+
+/*
+  Pages without a valid translation are left out, fault is set to the reason the first one of them failed.
+  Returns the number of chunks written to info, which needs room for every page of the range.
+*/
+static int FillRWInfo(const ProcessData* data, uint64_t dirBase, RWInfo* info, uint64_t local, uint64_t remote, size_t len, ssize_t* fault)
+{
+	RWInfo entry = {
+		.local = local,
+		.remote = remote,
+		.size = len
+	};
+	ssize_t pages;
 
-	*count = i;
+	return FillRWInfoMul(data, dirBase, &entry, info, 1, fault, &pages);
 }
@@ -18,6 +18,12 @@ extern "C" {
 
 #define MAX_BATCHED_RW 1024
 
+/* Per-entry errors reported by the *Status functions, successful entries get the number of bytes moved */
+#define RW_UNMAPPED -1
+#define RW_PAGED_OUT -2
+#define RW_OUT_OF_RANGE -3
+#define RW_FAILED -4
+
 typedef struct RWInfo
 {
 	uint64_t local;
@@ -25,11 +31,187 @@ typedef struct RWInfo
 	size_t size;
 } RWInfo;
 
+/* A virtually contiguous piece of a VMemView range, local is 0 when the memory is not mapped */
+typedef struct MemSpan
+{
+	uint64_t local;
+	uint64_t remote;
+	size_t size;
+} MemSpan;
+
+/* Access rights of a MemRange, combined from all levels of the page tables */
+#define VMEM_WRITABLE 1
+#define VMEM_USER 2
+#define VMEM_NX 4
+
+/* A virtually contiguous range of pages with the same size and access rights */
+typedef struct MemRange
+{
+	uint64_t start;
+	uint64_t size;
+	uint64_t pageSize;
+	uint32_t flags;
+} MemRange;
+
+/* Page size classes a translation can belong to */
+#define TLB_PAGE_4K 0
+#define TLB_PAGE_2M 1
+#define TLB_PAGE_1G 2
+#define TLB_PAGE_SIZES 3
+
+/* Histogram bucket i counts the values in [2^i, 2^(i + 1)), the last one everything above */
+#define MEM_STAT_BUCKETS 32
+
+/* Only made of size_t counters, which GetMemStats sums up over all threads */
 typedef struct {
 	size_t tlbHits;
 	size_t tlbMisses;
+	/* Valid entries replaced to make room for a new one */
+	size_t tlbEvictions;
+	/* The same, split by the size of the translated page */
+	size_t tlbSizeHits[TLB_PAGE_SIZES];
+	size_t tlbSizeMisses[TLB_PAGE_SIZES];
+	/* Lookups in the translation cache shared between threads, done after a miss in this one */
+	size_t sharedHits;
+	size_t sharedMisses;
+	/* Page walks that started from a cached upper level entry, and the ones that had to start from the top */
+	size_t pscHits;
+	size_t pscMisses;
+	/* Lookups answered by a cached failed translation, and failed translations that got cached */
+	size_t negativeHits;
+	size_t negativeFills;
+	/* Lookups answered by a global kernel translation cached under the system dirBase */
+	size_t globalHits;
+	/* Page table entries read by page walks, indexed by the level from PML5 to PT */
+	size_t walkReads[5];
+	/* Page table reads served from the page cache of the external backend, and the ones that loaded a page */
+	size_t pageCacheHits;
+	size_t pageCacheMisses;
+	/* Small reads served from the guest page cache, and the ones that had to load their page */
+	size_t dataCacheHits;
+	size_t dataCacheMisses;
+	/* Readahead batches, the pages they loaded into the guest page cache, and how many of those got read */
+	size_t readaheadBatches;
+	size_t readaheadPages;
+	size_t readaheadHits;
+	/* Calls made to the backend, and the bytes they moved */
+	size_t backendCalls;
+	size_t backendBytes;
+	/* RW entries submitted to the backend, and how many of them got merged into a neighbouring one */
+	size_t iovEntries;
+	size_t iovMerged;
+	/* Syscalls made by the external and procmem backends, and a histogram of the number of iovecs per syscall */
+	size_t iovCalls;
+	size_t iovCallSizes[MEM_STAT_BUCKETS];
+	/* Heap allocations made by the per-thread scratch memory of the batched operations, and their total size */
+	size_t scratchAllocs;
+	size_t scratchBytes;
+	/* Latency histograms in nanoseconds, only filled while SetMemStatsTiming is enabled */
+	size_t translateLatency[MEM_STAT_BUCKETS];
+	size_t vmemReadLatency[MEM_STAT_BUCKETS];
+	size_t readMulLatency[MEM_STAT_BUCKETS];
 } tlb_t;
 
+/**
+ * @brief Get the histogram bucket of a value
+ *
+ * @param value value to count
+ *
+ * @return
+ * Index of the bucket, below MEM_STAT_BUCKETS
+ */
+static inline size_t GetStatBucket(uint64_t value)
+{
+	size_t bucket = value ? 63 - __builtin_clzll(value) : 0;
+	return bucket < MEM_STAT_BUCKETS ? bucket : MEM_STAT_BUCKETS - 1;
+}
+
+/**
+ * @brief Find where a piece of guest physical memory is mapped
+ *
+ * @param data VM process data
+ * @param address guest physical address
+ * @param size size of the data
+ *
+ * The lookup is a branchless binary search over the region table.
+ *
+ * @return
+ * Address of the data in the backend's address space;
+ * 0 if the data does not fully lie within a single RAM region
+ */
+static inline uint64_t GetMemMapping(const ProcessData* data, uint64_t address, size_t size)
+{
+	const MemRegion* region = data->regions;
+	size_t count = data->regionCount;
+
+	while (count > 1) {
+		size_t half = count / 2;
+		region = region[half].start <= address ? region + half : region;
+		count -= half;
+	}
+
+	uint64_t offset = address - region->start;
+
+	if (!data->regionCount || offset >= region->size || region->size - offset < size)
+		return 0;
+
+	return region->mapping + offset;
+}
+
+/**
+ * @brief Lay out RAM blocks in guest physical address space
+ *
+ * @param data VM process data
+ * @param ram RAM blocks in guest order, only size and mapping are used
+ * @param count number of RAM blocks
+ * @param lowSize amount of RAM placed below the PCI hole
+ * @param highStart guest physical address where the rest of the RAM continues
+ *
+ * Rebuilds the region table of data. RAM blocks are placed one after another, starting at address 0,
+ * with everything past lowSize being moved up to highStart.
+ */
+void SetMemLayout(ProcessData* data, const MemRegion* ram, size_t count, uint64_t lowSize, uint64_t highStart);
+
+/* Available memory backends, see MemBackend */
+extern const MemBackend memBackendExternal;
+extern const MemBackend memBackendInject;
+extern const MemBackend memBackendKmod;
+extern const MemBackend memBackendMapped;
+extern const MemBackend memBackendFile;
+extern const MemBackend memBackendProcMem;
+
+/**
+ * @brief Open /proc/<pid>/mem of the VM process
+ *
+ * @param data VM process data
+ *
+ * Has to be done before switching to memBackendProcMem, which serves the reads with pread/preadv
+ * on the opened file, instead of process_vm_readv.
+ *
+ * @return
+ * 0 on success;
+ * -1 otherwise
+ */
+int OpenProcMem(ProcessData* data);
+
+/**
+ * @brief Close the file opened by OpenProcMem
+ *
+ * @param data VM process data
+ */
+void CloseProcMem(ProcessData* data);
+
+/**
+ * @brief Set the memory backend used by the process data
+ *
+ * @param data VM process data
+ * @param backend backend to be used
+ *
+ * The backend's function table is copied into the process data, so that memory operations
+ * are dispatched with a single indirect call. Normally InitializeContext picks the backend.
+ */
+void SetMemBackend(ProcessData* data, const MemBackend* backend);
+
 /**
  * @brief Read a piece of data in physical VM address space
  *
@@ -84,6 +266,40 @@ ssize_t MemReadMul(const ProcessData* data, RWInfo* info, size_t num);
  */
 ssize_t MemWriteMul(const ProcessData* data, RWInfo* info, size_t num);
 
+/**
+ * @brief Read multiple pieces of data in physical VM address space, reporting the result of every entry
+ *
+ * @param data VM process data
+ * @param info list of information for RW operations
+ * @param num number of info atoms
+ * @param status list of num results to be filled in
+ *
+ * Every status entry gets the number of bytes moved for the corresponding info atom, or one of the RW_
+ * error codes: RW_OUT_OF_RANGE if it does not fall into guest RAM, RW_FAILED if the backend could not
+ * access it. This is filled in while the batch is being processed, and does not cost any extra syscalls.
+ *
+ * @return
+ * Data moved on success;
+ * -1 otherwise
+ */
+ssize_t MemReadMulStatus(const ProcessData* data, RWInfo* info, size_t num, ssize_t* status);
+
+/**
+ * @brief Write multiple pieces of data in physical VM address space, reporting the result of every entry
+ *
+ * @param data VM process data
+ * @param info list of information for RW operations
+ * @param num number of info atoms
+ * @param status list of num results to be filled in
+ *
+ * Status entries are filled in the same way as in MemReadMulStatus.
+ *
+ * @return
+ * Data moved on success;
+ * -1 otherwise
+ */
+ssize_t MemWriteMulStatus(const ProcessData* data, RWInfo* info, size_t num, ssize_t* status);
+
 /**
  * @brief Read a unsigned 64-bit integer in virtual VM address space
  *
@@ -192,6 +408,67 @@ ssize_t VMemReadMul(const ProcessData* data, uint64_t dirBase, RWInfo* info, siz
  */
 ssize_t VMemWriteMul(const ProcessData* data, uint64_t dirBase, RWInfo* info, size_t num);
 
+/**
+ * @brief Read multiple pieces of data in virtual VM address space, reporting the result of every entry
+ *
+ * @param data VM process data
+ * @param dirBase page table directory base of a process
+ * @param info list of information for RW operations
+ * @param num number of info atoms
+ * @param status list of num results to be filled in
+ *
+ * Every status entry gets the number of bytes moved for the corresponding info atom, or the first error
+ * hit by any of its pages: RW_UNMAPPED if the page is not in the page tables, RW_PAGED_OUT if it is
+ * there but not resident, or the errors reported by MemReadMulStatus. Pages that could be read are
+ * still read when another page of the same atom fails.
+ *
+ * @return
+ * Data moved on success;
+ * -1 otherwise
+ */
+ssize_t VMemReadMulStatus(const ProcessData* data, uint64_t dirBase, RWInfo* info, size_t num, ssize_t* status);
+
+/**
+ * @brief Write multiple pieces of data in virtual VM address space, reporting the result of every entry
+ *
+ * @param data VM process data
+ * @param dirBase page table directory base of a process
+ * @param info list of information for RW operations
+ * @param num number of info atoms
+ * @param status list of num results to be filled in
+ *
+ * Status entries are filled in the same way as in VMemReadMulStatus.
+ *
+ * @return
+ * Data moved on success;
+ * -1 otherwise
+ */
+ssize_t VMemWriteMulStatus(const ProcessData* data, uint64_t dirBase, RWInfo* info, size_t num, ssize_t* status);
+
+/**
+ * @brief Get direct access to a range in virtual VM address space
+ *
+ * @param data VM process data
+ * @param dirBase page table directory base of a process
+ * @param remote remote data address
+ * @param size size of data
+ * @param buffer local buffer of at least size bytes, used by backends that can not map the memory, can be 0 otherwise
+ * @param spans list of spans to be filled in
+ * @param count number of spans available, set to the number of spans filled in
+ *
+ * When the backend has the guest memory mapped (qemu_inject, kmod, mapped and file modes), every span
+ * points straight into the guest RAM, and pages that are both virtually and physically contiguous are
+ * merged into one span. Writes through the spans modify the guest memory. Unmapped pages are returned
+ * as spans with a local address of 0. In other modes the range is read into buffer, and a single span
+ * pointing to it is returned. If there are not enough spans to describe the whole range, the call can
+ * be repeated starting at remote + returned size.
+ *
+ * @return
+ * Size of the range described by the spans on success;
+ * -1 otherwise
+ */
+ssize_t VMemView(const ProcessData* data, uint64_t dirBase, uint64_t remote, size_t size, uint64_t buffer, MemSpan* spans, size_t* count);
+
 /**
  * @brief Translate a virtual VM address into a physical one
  *
@@ -205,6 +482,40 @@ ssize_t VMemWriteMul(const ProcessData* data, uint64_t dirBase, RWInfo* info, si
  */
 uint64_t VTranslate(const ProcessData* data, uint64_t dirBase, uint64_t address);
 
+/**
+ * @brief Translate multiple virtual VM addresses into physical ones
+ *
+ * @param data VM process data
+ * @param dirBase page table directory base of a process
+ * @param addresses list of virtual addresses to translate
+ * @param out list of n translated addresses to be filled in, can be the same as addresses
+ * @param n number of addresses
+ *
+ * Addresses missing from the TLB are walked together, one page table level at a time. Every page table entry
+ * needed by the batch is read only once, and all entries of a level are read with a single MemReadMul, thus a
+ * cold batch in external mode costs a handful of syscalls instead of up to 4 per address. Addresses that could
+ * not be translated get 0.
+ */
+void VTranslateMul(const ProcessData* data, uint64_t dirBase, const uint64_t* addresses, uint64_t* out, size_t n);
+
+/**
+ * @brief List every mapped range of a virtual address space
+ *
+ * @param data VM process data
+ * @param dirBase page table directory base of a process
+ * @param ranges set to a list of ranges, sorted by address, that has to be freed by the caller
+ *
+ * The whole page table tree is walked, with page tables of each level read in bulk through MemReadMul, and
+ * the four quarters of the top level table walked on separate threads. Neighbouring pages of the same size and access
+ * rights are merged into a single range. Pages the guest keeps in transition are reported as mapped, in the
+ * same way VTranslate translates them.
+ *
+ * @return
+ * Number of ranges on success;
+ * -1 otherwise
+ */
+ssize_t VMemEnumerate(const ProcessData* data, uint64_t dirBase, MemRange** ranges);
+
 /**
  * @brief Set translation cache validity time in msecs
  *
@@ -212,7 +523,9 @@ uint64_t VTranslate(const ProcessData* data, uint64_t dirBase, uint64_t address)
  *
  * Defines for how long translation caches (TLB and page buffer) should be valid. Higher values lead to higher
  * performance, but could potentially lead to incorrect translation if the page tables update in that period.
- * Especially dangerous if write operations are to be performed.
+ * Especially dangerous if write operations are to be performed. Entries are expired by a background timer in
+ * steps of half of this time, thus an entry lives for at least half and at most the full time. Passing 0
+ * disables the caches.
  */
 void SetMemCacheTime(size_t newTime);
 
@@ -224,6 +537,113 @@ void SetMemCacheTime(size_t newTime);
  */
 size_t GetDefaultMemCacheTime(void);
 
+/**
+ * @brief Invalidate the translation caches of all threads
+ *
+ * Moves the cache to a new epoch, after which none of the existing TLB, page buffer or shared cache entries are
+ * valid anymore. This is only a counter increment, thus it can be called whenever the caller knows the page
+ * tables changed, for example after a process exited.
+ */
+void InvalidateMemCache(void);
+
+/**
+ * @brief Stop the background timer of the translation caches
+ *
+ * The timer is started by the first translation, and wakes up every half of the cache time. This stops it, so that
+ * a process done with reading memory has no wakeups left. The next translation starts it again, with everything
+ * cached before then expired. FreeContext calls this.
+ */
+void StopMemCacheTimer(void);
+
+/**
+ * @brief Set the dirBase of the system process
+ *
+ * @param dirBase directory base of the system process, 0 disables the sharing of kernel translations
+ *
+ * Kernel half pages with the global bit set map to the same memory in every address space. Their translations
+ * are cached under this dirBase, no matter which address space walked them, and lookups from all address spaces
+ * fall back to them. Walking the kernel memory of many processes then only misses once for every kernel page.
+ * Kernel pages without the global bit, like the session space, are still cached per address space.
+ * InitializeContext sets this to the dirBase of the initial process.
+ */
+void SetKernelDirBase(uint64_t dirBase);
+
+/**
+ * @brief Reserve a part of the TLB for an address space
+ *
+ * @param dirBase directory base of the address space, for example the dirBase of a WinProc
+ * @param ways number of ways of every TLB set to reserve, 0 removes the reservation
+ *
+ * TLB sets are indexed by the address space as well as the address, thus processes with the same virtual
+ * layout do not evict each other's entries just because of that. A reservation goes further, and keeps
+ * translations of other address spaces out of the reserved ways in the TLBs of all threads, so that a busy
+ * process cannot push the working set of a monitored one out of the TLB. The address space can still use
+ * the shared ways on top of its reserved ones. At least one way of every set is always left shared.
+ *
+ * @return
+ * 0 on success;
+ * -1 if the reservation does not fit
+ */
+int SetTlbReservation(uint64_t dirBase, size_t ways);
+
+/**
+ * @brief Enable or disable the translation cache shared between threads
+ *
+ * @param enabled whether the shared cache should be used
+ *
+ * When enabled, translations missing from the TLB of the calling thread are looked up in a process-wide cache
+ * before walking the page tables, and every walk fills it in. The cache is read without taking any locks, thus
+ * worker threads accessing the same memory share their warm translations instead of repeating the same walks.
+ * Entries expire the same way as the TLB ones, and FlushTlb invalidates the whole shared cache. Disabled by default.
+ */
+void SetSharedTlb(int enabled);
+
+/**
+ * @brief Set the memory budget of the guest page cache
+ *
+ * @param budget size of the cache in bytes, 0 disables it
+ *
+ * Only used by backends that need a syscall for every read, like the external one. Reads of up to 256 bytes
+ * that stay within a single page are served from cached copies of guest physical pages, and a miss loads the
+ * whole page. The least recently used pages are evicted to stay within the budget. Pages expire in the same way
+ * translations do (see SetMemCacheTime), and writes through MemWrite, VMemWrite and the batched writes drop the
+ * pages they touch. Memory changed by the guest itself is only picked up once the page expired. Disabled by default.
+ */
+void SetMemPageCache(size_t budget);
+
+/**
+ * @brief Set the largest readahead batch of VMemRead
+ *
+ * @param maxPages largest number of pages loaded ahead at once, 0 disables readahead
+ *
+ * Every thread follows a few streams of single page VMemRead and VMemReadU64 calls, within one address space
+ * each. Once a stream moved forward by the same number of pages twice, the next pages it is going to read are
+ * translated and loaded into the guest page cache with a single batched read. Batches start at 4 pages and double
+ * up to maxPages, and are capped at a quarter of the cache. Walking a remote array with small reads then costs a
+ * syscall per batch instead of one per read. Only works while the guest page cache is enabled, see SetMemPageCache.
+ * Disabled by default.
+ */
+void SetMemReadahead(size_t maxPages);
+
+/**
+ * @brief Set the number of threads used by large MemReadMul batches
+ *
+ * @param count number of threads, including the calling one
+ *
+ * Batches that are large enough get split into equal slices, which are read in parallel by a persistent
+ * worker pool and the calling thread. The byte counts of the slices are summed up, and -1 is returned only
+ * if every slice failed. Passing 0 or 1 disables the parallel mode (which is the default) and stops the pool.
+ */
+void SetMemThreads(size_t count);
+
+/**
+ * @brief Get the number of threads used by large MemReadMul batches
+ *
+ * @return
+ * Thread count, including the calling thread
+ */
+size_t GetMemThreads(void);
+
 /**
  * @brief Retrieve current thread's TLB
  *
@@ -236,6 +656,35 @@ size_t GetDefaultMemCacheTime(void);
  */
 tlb_t* GetTlb(void);
 
+/**
+ * @brief Get the statistics of all threads
+ *
+ * @param stats receives the sum of the counters of every thread, including the ones that already exited
+ *
+ * Threads only ever touch their own counters, which are summed up on demand, so keeping them does not slow
+ * the memory operations down. Counters of running threads may be a moment behind.
+ */
+void GetMemStats(tlb_t* stats);
+
+/**
+ * @brief Free the scratch memory of the calling thread
+ *
+ * VMemRead, VMemWrite and the batched operations expand their requests in per-thread scratch memory, which grows
+ * to fit the largest request and is kept around for the next one. This gives it back after a one-off large request.
+ * It is freed automatically when the thread exits.
+ */
+void FreeMemScratch(void);
+
+/**
+ * @brief Enable or disable the latency histograms
+ *
+ * @param enabled whether VTranslate, VMemRead and MemReadMul should be timed
+ *
+ * Timing reads the clock twice per call, which costs more than a translation hitting the TLB, thus it is
+ * disabled by default. The rest of the counters are always kept.
+ */
+void SetMemStatsTiming(int enabled);
+
 /**
  * @brief Verify the TLB entries
  *
@@ -250,8 +699,92 @@ tlb_t* GetTlb(void);
  *
  * splitCount allows us to split the TLB entries to verify to separate threads. Passing 1 to splitCount makes
  * the function verify the entirety of TLB (single-threaded scenario)
+ *
+ * Only hot entries, the ones still valid or hit since they were last considered for eviction, are walked again.
+ * The walks use the caches of the calling thread, thus the slices can be verified from any threads, as long as
+ * the thread owning the TLB does not translate in the meantime.
+ *
+ * @return
+ * Number of entries whose translation changed
+ */
+size_t VerifyTlb(const ProcessData* data, tlb_t* tlb, size_t splitCount, size_t splitID);
+
+/**
+ * @brief Verify the entries of the shared translation cache
+ *
+ * @param data VM process data
+ * @param splitCount how many splits there are
+ * @param splitID which slice to verify
+ *
+ * Same as VerifyTlb, but for the cache enabled by SetSharedTlb. Entries are updated under their sequence numbers,
+ * thus this is safe to run while other threads translate.
+ *
+ * @return
+ * Number of entries whose translation changed
+ */
+size_t VerifySharedTlb(const ProcessData* data, size_t splitCount, size_t splitID);
+
+/**
+ * @brief Start or stop the background TLB revalidation service
+ *
+ * @param data VM process data used for the page walks
+ * @param threads number of service threads, 0 stops the service
+ * @param intervalMS delay between revalidation rounds
+ *
+ * Every round runs VerifyTlb on the registered TLBs, and VerifySharedTlb when the shared cache is enabled,
+ * split between the service threads. Keeping the hot translations fresh this way makes the reads that follow
+ * hit the cache instead of walking the page tables.
+ *
+ * @return
+ * 0 on success;
+ * -1 if not all of the threads could be started
+ */
+int SetTlbRevalidation(const ProcessData* data, size_t threads, size_t intervalMS);
+
+/**
+ * @brief Register a TLB for background revalidation
+ *
+ * @param tlb TLB structure, as returned by GetTlb
+ *
+ * Registered TLBs get updated in place, thus their threads have to wrap the work that translates addresses
+ * in PauseTlbRevalidation and ResumeTlbRevalidation, so that the revalidation happens between frames.
+ * A thread has to unregister its TLB before exiting.
+ *
+ * @return
+ * 0 on success;
+ * -1 if there are too many TLBs registered
+ */
+int RegisterTlb(tlb_t* tlb);
+
+/**
+ * @brief Stop revalidating a TLB
+ *
+ * @param tlb TLB structure passed to RegisterTlb
+ *
+ * Waits for the round in progress to finish.
+ */
+void UnregisterTlb(tlb_t* tlb);
+
+/**
+ * @brief Hold off the revalidation of registered TLBs
+ *
+ * Waits for the round in progress to finish, and keeps new ones from starting until the matching
+ * ResumeTlbRevalidation call. Calls from multiple threads stack.
+ */
+void PauseTlbRevalidation(void);
+
+/**
+ * @brief Allow revalidation rounds again after PauseTlbRevalidation
+ */
+void ResumeTlbRevalidation(void);
+
+/**
+ * @brief Get the revalidation statistics
+ *
+ * @param rounds receives the number of rounds finished
+ * @param changed receives the total number of translations that were found to have changed
  */
-void VerifyTlb(const ProcessData* data, tlb_t* tlb, size_t splitCount, size_t splitID);
+void GetTlbRevalidationStats(size_t* rounds, size_t* changed);
 
 /**
  * @brief Flush all TLB entries
@@ -1,11 +1,47 @@
 #ifndef PROCESSDATA_H
 #define PROCESSDATA_H
 
+#ifndef MAX_MEM_REGIONS
+#define MAX_MEM_REGIONS 16
+#endif
+
+struct RWInfo;
+struct ProcessData;
+
+/* A piece of guest physical RAM, and where the backend has it mapped */
+typedef struct MemRegion
+{
+	uint64_t start;
+	uint64_t size;
+	uint64_t mapping;
+} MemRegion;
+
+typedef struct MemBackend
+{
+	const char* name;
+	int mode;
+	ssize_t (*read)(const struct ProcessData* data, uint64_t local, uint64_t remote, size_t size);
+	ssize_t (*write)(const struct ProcessData* data, uint64_t local, uint64_t remote, size_t size);
+	/* status is optional, when set it receives the result of every entry */
+	ssize_t (*readMul)(const struct ProcessData* data, struct RWInfo* info, size_t num, ssize_t* status);
+	ssize_t (*writeMul)(const struct ProcessData* data, struct RWInfo* info, size_t num, ssize_t* status);
+	/* Local address of a guest physical range, NULL for backends that have to copy the memory */
+	uint64_t (*map)(const struct ProcessData* data, uint64_t remote, size_t size);
+} MemBackend;
+
 typedef struct ProcessData
 {
 	uint64_t mapsStart;
 	uint64_t mapsSize;
 	pid_t pid;
+	/* /proc/<pid>/mem, only used by the procmem backend */
+	int memFd;
+	MemBackend backend;
+	/* Depth of the guest page tables, 5 when LA57 is enabled, anything else means 4 */
+	int pagingLevels;
+	/* Sorted by start address */
+	MemRegion regions[MAX_MEM_REGIONS];
+	size_t regionCount;
 } ProcessData;
 
 #endif
@@ -3,18 +3,9 @@
 #include <sys/uio.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
 
-/* Memory read implementation using linux process_vm_ functions */
-
-/*
-  On windows, first 2^31 physical bytes are really allocated for various PCI device mappings and do not point to actual physical RAM (mmapped region in QEMU case).
-  It also differs on Windows XP. This should be solved by injecting code into the kernel to retrieve the actual physical memory map of the system
-*/
-extern uint64_t KFIXC;
-extern uint64_t KFIXO;
-uint64_t KFIXC = 0x80000000;
-uint64_t KFIXO = 0x80000000;
-#define KFIX2(x) ((x) < KFIXC ? (x) : ((x) - KFIXO))
+/* Memory read implementation using linux process_vm_ functions, or reads on /proc/<pid>/mem */
 
 ssize_t process_vm_readv(pid_t pid,
 						 const struct iovec *local_iov,
@@ -30,82 +21,280 @@ ssize_t process_vm_writev(pid_t pid,
 						  unsigned long riovcnt,
 						  unsigned long flags);
 
-ssize_t MemRead(const ProcessData* data, uint64_t localAddr, uint64_t remoteAddr, size_t len)
-{
-	struct iovec local;
-	struct iovec remote;
-	local.iov_base = (void*)localAddr;
-	local.iov_len = len;
-	remote.iov_base = (void*)(data->mapsStart + KFIX2(remoteAddr));
-	remote.iov_len = len;
-	return process_vm_readv(data->pid, &local, 1, &remote, 1, 0);
-}
+typedef ssize_t (*vmrw_t)(pid_t, const struct iovec*, unsigned long, const struct iovec*, unsigned long, unsigned long);
 
-ssize_t MemReadMul(const ProcessData* data, RWInfo* rdata, size_t num)
+static void SetBatchStatus(const RWInfo* info, ssize_t* status, size_t start, size_t end, size_t num, ssize_t moved);
+
+static ssize_t ExtMemRW(const ProcessData* data, RWInfo* info, size_t num, ssize_t* status, vmrw_t rw)
 {
 	struct iovec local[__IOV_MAX];
 	struct iovec remote[__IOV_MAX];
-	size_t i = 0;
-	size_t startRead = 0;
+	size_t count = 0;
+	size_t valid = 0;
+	size_t merged = 0;
+	size_t batchStart = 0;
 
+	tlb_t* stats = GetTlb();
 	ssize_t ret = 0;
 
-	for (i = 0; i < num; i++) {
-		local[i - startRead].iov_base = (void*)rdata[i].local;
-		local[i - startRead].iov_len = rdata[i].size;
-		remote[i - startRead].iov_base = (void*)(data->mapsStart + KFIX2(rdata[i].remote));
-		remote[i - startRead].iov_len = rdata[i].size;
-
-		if (i - startRead + 1 >= __IOV_MAX) {
-			ret = process_vm_readv(data->pid, local, __IOV_MAX, remote, __IOV_MAX, 0);
-			if (ret == -1)
-				return ret;
-			startRead = i + 1;
+	for (size_t i = 0; i < num; i++) {
+		uint64_t remoteAddr = GetMemMapping(data, info[i].remote, info[i].size);
+
+		/* Skip anything that falls into MMIO holes, instead of reading unrelated memory */
+		if (!remoteAddr) {
+			if (status)
+				status[i] = RW_OUT_OF_RANGE;
+			continue;
+		}
+
+		if (status)
+			status[i] = 0;
+
+		valid++;
+
+		/* Entries contiguous on both sides go into a single iovec, this saves a lot of them on larger reads */
+		if (count && (uint64_t)local[count - 1].iov_base + local[count - 1].iov_len == info[i].local
+			&& (uint64_t)remote[count - 1].iov_base + remote[count - 1].iov_len == remoteAddr) {
+			local[count - 1].iov_len += info[i].size;
+			remote[count - 1].iov_len += info[i].size;
+			merged++;
+			continue;
+		}
+
+		if (count >= __IOV_MAX) {
+			ssize_t moved = rw(data->pid, local, count, remote, count, 0);
+			stats->iovCalls++;
+			stats->iovCallSizes[GetStatBucket(count)]++;
+			if (status)
+				SetBatchStatus(info, status, batchStart, i, num, moved);
+			if (moved == -1)
+				return moved;
+			ret += moved;
+			count = 0;
+			batchStart = i;
 		}
+
+		local[count].iov_base = (void*)info[i].local;
+		local[count].iov_len = info[i].size;
+		remote[count].iov_base = (void*)remoteAddr;
+		remote[count].iov_len = info[i].size;
+		count++;
+	}
+
+	if (count) {
+		ssize_t moved = rw(data->pid, local, count, remote, count, 0);
+		stats->iovCalls++;
+		stats->iovCallSizes[GetStatBucket(count)]++;
+		if (status)
+			SetBatchStatus(info, status, batchStart, num, num, moved);
+		if (moved == -1)
+			return moved;
+		ret += moved;
 	}
 
-	if (i != startRead)
-	    ret = process_vm_readv(data->pid, local, i - startRead, remote, i - startRead, 0);
+	stats->iovEntries += valid;
+	stats->iovMerged += merged;
 
-	return ret;
+	return num && !valid ? -1 : ret;
 }
 
-ssize_t MemWrite(const ProcessData* data, uint64_t localAddr, uint64_t remoteAddr, size_t len)
+static ssize_t ExtMemRead(const ProcessData* data, uint64_t localAddr, uint64_t remoteAddr, size_t len)
 {
 	struct iovec local;
 	struct iovec remote;
 	local.iov_base = (void*)localAddr;
 	local.iov_len = len;
-	remote.iov_base = (void*)(data->mapsStart + KFIX2(remoteAddr));
+	remote.iov_base = (void*)GetMemMapping(data, remoteAddr, len);
 	remote.iov_len = len;
+	if (!remote.iov_base)
+		return -1;
+	return process_vm_readv(data->pid, &local, 1, &remote, 1, 0);
+}
+
+static ssize_t ExtMemReadMul(const ProcessData* data, RWInfo* rdata, size_t num, ssize_t* status)
+{
+	return ExtMemRW(data, rdata, num, status, process_vm_readv);
+}
+
+static ssize_t ExtMemWrite(const ProcessData* data, uint64_t localAddr, uint64_t remoteAddr, size_t len)
+{
+	struct iovec local;
+	struct iovec remote;
+	local.iov_base = (void*)localAddr;
+	local.iov_len = len;
+	remote.iov_base = (void*)GetMemMapping(data, remoteAddr, len);
+	remote.iov_len = len;
+	if (!remote.iov_base)
+		return -1;
 	return process_vm_writev(data->pid, &local, 1, &remote, 1, 0);
 }
 
-ssize_t MemWriteMul(const ProcessData* data, RWInfo* wdata, size_t num)
+static ssize_t ExtMemWriteMul(const ProcessData* data, RWInfo* wdata, size_t num, ssize_t* status)
+{
+	return ExtMemRW(data, wdata, num, status, process_vm_writev);
+}
+
+int OpenProcMem(ProcessData* data)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/mem", data->pid);
+
+	int fd = open(path, O_RDWR);
+
+	if (fd == -1)
+		return -1;
+
+	data->memFd = fd;
+
+	return 0;
+}
+
+void CloseProcMem(ProcessData* data)
+{
+	close(data->memFd);
+	data->memFd = -1;
+}
+
+/*
+  The file offset is the remote address, thus one preadv/pwritev call can only cover a contiguous remote range.
+  Consecutive entries that continue the range are gathered into the same call, and the ones contiguous locally share an iovec.
+*/
+static ssize_t ProcMemRW(const ProcessData* data, RWInfo* info, size_t num, ssize_t* status, int write)
 {
 	struct iovec local[__IOV_MAX];
-	struct iovec remote[__IOV_MAX];
-	size_t i;
-	size_t startWrite = 0;
+	size_t count = 0;
+	size_t valid = 0;
+	size_t merged = 0;
+	size_t batchStart = 0;
+	uint64_t start = 0;
+	uint64_t next = 0;
 
+	tlb_t* stats = GetTlb();
 	ssize_t ret = 0;
 
-	for (i = 0; i < num; i++) {
-		local[i - startWrite].iov_base = (void*)wdata[i].local;
-		local[i - startWrite].iov_len = wdata[i].size;
-		remote[i - startWrite].iov_base = (void*)(data->mapsStart + KFIX2(wdata[i].remote));
-		remote[i - startWrite].iov_len = wdata[i].size;
-
-		if (i - startWrite >= (size_t)__IOV_MAX) {
-			ret = process_vm_writev(data->pid, local, __IOV_MAX, remote, __IOV_MAX, 0);
-			if (ret == -1)
-				return ret;
-			startWrite = i + 1;
+	for (size_t i = 0; i <= num; i++) {
+		uint64_t remoteAddr = 0;
+
+		if (i < num) {
+			remoteAddr = GetMemMapping(data, info[i].remote, info[i].size);
+
+			if (!remoteAddr) {
+				if (status)
+					status[i] = RW_OUT_OF_RANGE;
+				continue;
+			}
+
+			if (status)
+				status[i] = 0;
+
+			valid++;
+
+			if (count && remoteAddr == next && (uint64_t)local[count - 1].iov_base + local[count - 1].iov_len == info[i].local) {
+				local[count - 1].iov_len += info[i].size;
+				next += info[i].size;
+				merged++;
+				continue;
+			}
 		}
+
+		if (count && (i == num || remoteAddr != next || count >= __IOV_MAX)) {
+			ssize_t moved = write ? pwritev(data->memFd, local, count, (off_t)start) : preadv(data->memFd, local, count, (off_t)start);
+			stats->iovCalls++;
+			stats->iovCallSizes[GetStatBucket(count)]++;
+			if (status)
+				SetBatchStatus(info, status, batchStart, i, num, moved);
+			if (moved == -1)
+				return moved;
+			ret += moved;
+			count = 0;
+			batchStart = i;
+		}
+
+		if (i == num)
+			break;
+
+		if (!count)
+			start = remoteAddr;
+
+		local[count].iov_base = (void*)info[i].local;
+		local[count].iov_len = info[i].size;
+		next = remoteAddr + info[i].size;
+		count++;
 	}
 
-	if (i != startWrite)
-		ret = process_vm_writev(data->pid, local, i - startWrite, remote, i - startWrite, 0);
+	stats->iovEntries += valid;
+	stats->iovMerged += merged;
+
+	return num && !valid ? -1 : ret;
+}
+
+static ssize_t ProcMemRead(const ProcessData* data, uint64_t localAddr, uint64_t remoteAddr, size_t len)
+{
+	uint64_t remote = GetMemMapping(data, remoteAddr, len);
+	if (!remote)
+		return -1;
+	return pread(data->memFd, (void*)localAddr, len, (off_t)remote);
+}
+
+static ssize_t ProcMemReadMul(const ProcessData* data, RWInfo* rdata, size_t num, ssize_t* status)
+{
+	return ProcMemRW(data, rdata, num, status, 0);
+}
+
+static ssize_t ProcMemWrite(const ProcessData* data, uint64_t localAddr, uint64_t remoteAddr, size_t len)
+{
+	uint64_t remote = GetMemMapping(data, remoteAddr, len);
+	if (!remote)
+		return -1;
+	return pwrite(data->memFd, (void*)localAddr, len, (off_t)remote);
+}
+
+static ssize_t ProcMemWriteMul(const ProcessData* data, RWInfo* wdata, size_t num, ssize_t* status)
+{
+	return ProcMemRW(data, wdata, num, status, 1);
+}
+
+const MemBackend memBackendExternal = {
+	.name = "external",
+	.mode = MODE_EXTERNAL(),
+	.read = ExtMemRead,
+	.write = ExtMemWrite,
+	.readMul = ExtMemReadMul,
+	.writeMul = ExtMemWriteMul
+};
+
+const MemBackend memBackendProcMem = {
+	.name = "procmem",
+	.mode = MODE_PROCMEM(),
+	.read = ProcMemRead,
+	.write = ProcMemWrite,
+	.readMul = ProcMemReadMul,
+	.writeMul = ProcMemWriteMul
+};
+
+/*
+  Spread the bytes moved by a single call over the entries it covered, in order.
+  Entries that were already rejected keep their error code, the rest are expected to be set to 0 beforehand.
+  A failed call also fails everything after it, since the caller gives up on the rest of the list.
+*/
+static void SetBatchStatus(const RWInfo* info, ssize_t* status, size_t start, size_t end, size_t num, ssize_t moved)
+{
+	for (size_t i = start; i < end; i++) {
+		if (status[i] < 0)
+			continue;
+
+		if (moved == -1) {
+			status[i] = RW_FAILED;
+		} else if ((size_t)moved >= info[i].size) {
+			status[i] = info[i].size;
+			moved -= info[i].size;
+		} else {
+			status[i] = moved ? moved : RW_FAILED;
+			moved = 0;
+		}
+	}
 
-	return ret;
+	if (moved == -1)
+		for (size_t i = end; i < num; i++)
+			status[i] = RW_FAILED;
 }
@@ -4,20 +4,25 @@
 #include <errno.h>
 #include <string.h>
 
-#ifdef KMOD_MEMMAP
+#include "filemem.h"
 #include "kmem.h"
-#include <sys/mman.h>
-#include <sys/ioctl.h>
-#endif
-
-#if (LMODE() != MODE_QEMU_INJECT())
+#include <unistd.h>
 #include <sys/types.h>
+#include <sys/ioctl.h>
 #include <dirent.h>
-#endif
+#include <fcntl.h>
+#include <sys/mman.h>
 
 char* strdup(const char*);
 
-static int CheckLow(const WinCtx* ctx, uint64_t* pml4, uint64_t* kernelEntry);
+static size_t FindRamBlocks(procmaps_struct* maps, procmaps_struct** blocks, MemRegion* ram, size_t maxCount);
+static size_t GetRamBlocks(const ProcessData* data, MemRegion* ram);
+static void SetupMemLayout(ProcessData* data, const MemRegion* ram, size_t count, int pcLayout);
+static int MapKmod(WinCtx* ctx, MemRegion* ram, size_t count);
+static int MapBackingFiles(pid_t pid, procmaps_struct** blocks, MemRegion* ram, size_t count);
+static void UnmapBackingFiles(ProcessData* data);
+static int InitializeKernel(WinCtx* ctx);
+static int CheckLow(const WinCtx* ctx, uint64_t* pml4, uint64_t* kernelEntry, int* pagingLevels);
 static void FindNTKernel(WinCtx* ctx, uint64_t kernelEntry);
 static uint16_t GetNTVersion(const WinCtx* ctx);
 static uint32_t GetNTBuild(const WinCtx* ctx);
@@ -27,16 +32,17 @@ static void FillAnyModuleList64(const WinCtx* ctx, const WinProc* process, WinMo
 static void FillModuleList64(const WinCtx* ctx, const WinProc* process, WinModuleList* list, size_t* maxSize, char* x86);
 static void FillModuleList32(const WinCtx* ctx, const WinProc* process, WinModuleList* list, size_t* maxSize);
 
-extern uint64_t KFIXC;
-extern uint64_t KFIXO;
-
 FILE* vmread_dfile = NULL;
 
 #ifndef HEADER_SIZE
 #define HEADER_SIZE 0x1000
 #endif
 
-#if (LMODE() != MODE_QEMU_INJECT())
+/* Additional RAM blocks (NUMA nodes, multiple memory backends) are at least this large */
+#ifndef MIN_RAM_BLOCK_SIZE
+#define MIN_RAM_BLOCK_SIZE 0x10000000
+#endif
+
 static int RecursFind(const char* path, int level) {
 	if (level > 2)
 		return 0;
@@ -66,23 +72,30 @@ static int RecursFind(const char* path, int level) {
 
 	return ret;
 }
-#endif
 
 static pid_t FindKVMProcess()
 {
-#if (LMODE() == MODE_QEMU_INJECT())
-	return getpid();
-#else
-	pid_t ret = RecursFind("/proc", 0);
+	char path[64];
+
+	/* Prefer ourselves, in case we are injected into the QEMU process */
+	snprintf(path, sizeof(path), "/proc/%d", getpid());
+
+	pid_t ret = RecursFind(path, 1);
+
+	if (ret <= 0)
+		ret = RecursFind("/proc", 0);
+
 	return ret > 0 ? ret : 0;
-#endif
 }
 
 int InitializeContext(WinCtx* ctx, pid_t pid)
 {
-	memset(ctx, 0, sizeof(WinCtx));
+	return InitializeContextMode(ctx, pid, MODE_AUTO());
+}
 
-	uint64_t pml4, kernelEntry;
+int InitializeContextMode(WinCtx* ctx, pid_t pid, int mode)
+{
+	memset(ctx, 0, sizeof(WinCtx));
 
 	if (pid == 0 && (pid = FindKVMProcess()) == 0)
 		return -1;
@@ -92,97 +105,91 @@ int InitializeContext(WinCtx* ctx, pid_t pid)
 	if (!maps)
 		return 1;
 
-	procmaps_struct* tempMaps = NULL;
-	procmaps_struct* largestMaps = NULL;
+	procmaps_struct* blocks[MAX_MEM_REGIONS / 2];
+	MemRegion ram[MAX_MEM_REGIONS / 2];
+	size_t ramCount = FindRamBlocks(maps, blocks, ram, MAX_MEM_REGIONS / 2);
 
-	while ((tempMaps = pmparser_next()) != NULL)
-		if (!largestMaps || tempMaps->length > largestMaps->length)
-			largestMaps = tempMaps;
-
-	if (!largestMaps)
+	if (!ramCount) {
+		pmparser_free(maps);
 		return 2;
+	}
 
 	ctx->process.pid = pid;
-	ctx->process.mapsStart = (uint64_t)largestMaps->addr_start;
-	ctx->process.mapsSize = largestMaps->length;
-
-	pmparser_free(maps);
-
-#ifdef KMOD_MEMMAP
-	MSG(2, "Mapping VM memory, this will take a second...\n");
-
-	int fd = open("/proc/vmread", O_RDWR);
 
-	if (fd != -1) {
-		int ret = ioctl(fd, VMREAD_IOCTL_MAPVMMEM, &ctx->process);
-		close(fd);
-		if (ret)
-			return 101;
-	} else
+	/* Pick the fastest available way to access the memory, unless told otherwise */
+	if (pid == getpid() && (mode == MODE_AUTO() || mode == MODE_QEMU_INJECT()))
+		SetMemBackend(&ctx->process, &memBackendInject);
+	else if ((mode == MODE_AUTO() || mode == MODE_KMOD()) && !MapKmod(ctx, ram, ramCount))
+		SetMemBackend(&ctx->process, &memBackendKmod);
+	else if ((mode == MODE_AUTO() || mode == MODE_MAPPED()) && !MapBackingFiles(pid, blocks, ram, ramCount))
+		SetMemBackend(&ctx->process, &memBackendMapped);
+	else if (mode == MODE_AUTO() || mode == MODE_EXTERNAL())
+		SetMemBackend(&ctx->process, &memBackendExternal);
+	else if (mode == MODE_PROCMEM() && !OpenProcMem(&ctx->process))
+		SetMemBackend(&ctx->process, &memBackendProcMem);
+	else {
+		pmparser_free(maps);
 		return 100;
-#endif
-
-	MSG(2, "Mem:\t%lx\t| Size:\t%lx\n", ctx->process.mapsStart, ctx->process.mapsSize);
-
-	if (!CheckLow(ctx, &pml4, &kernelEntry))
-		return 3;
-
-	MSG(2, "PML4:\t%lx\t| KernelEntry:\t%lx\n", pml4, kernelEntry);
-
-	ctx->initialProcess.dirBase = pml4;
-	FindNTKernel(ctx, kernelEntry);
+	}
 
-	if (!ctx->ntKernel) {
-		/* Test in case we are running XP (QEMU AddressSpace is different) */
-#if (LMODE() != MODE_DMA())
-		KFIXC = 0x40000000ll * 4;
-		KFIXO = 0x40000000;
-		FindNTKernel(ctx, kernelEntry);
-#endif
+	pmparser_free(maps);
 
-		if (!ctx->ntKernel)
-			return 4;
+	for (size_t i = 0; i < ramCount; i++) {
+		if (ram[i].size > ctx->process.mapsSize) {
+			ctx->process.mapsStart = ram[i].mapping;
+			ctx->process.mapsSize = ram[i].size;
+		}
 	}
 
-	MSG(2, "Kernel Base:\t%lx (%lx)\n", ctx->ntKernel, VTranslate(&ctx->process, ctx->initialProcess.dirBase, ctx->ntKernel));
-
-	uint64_t initialSystemProcess = FindProcAddress(ctx->ntExports, "PsInitialSystemProcess");
+	SetupMemLayout(&ctx->process, ram, ramCount, 0);
 
-	if (!initialSystemProcess)
-		return 6;
+	MSG(2, "Memory backend:\t%s\n", ctx->process.backend.name);
 
-	MSG(2, "PsInitialSystemProcess:\t%lx (%lx)\n", initialSystemProcess, VTranslate(&ctx->process, ctx->initialProcess.dirBase, initialSystemProcess));
-	VMemRead(&ctx->process, ctx->initialProcess.dirBase, (uint64_t)&ctx->initialProcess.process, initialSystemProcess, sizeof(uint64_t));
+	int ret = InitializeKernel(ctx);
 
-	if (!ctx->initialProcess.process)
-		return 7;
+	if (ret && ctx->process.backend.mode == MODE_PROCMEM())
+		CloseProcMem(&ctx->process);
+	else if (ret && ctx->process.backend.mode == MODE_MAPPED())
+		UnmapBackingFiles(&ctx->process);
 
-	ctx->initialProcess.physProcess = VTranslate(&ctx->process, ctx->initialProcess.dirBase, ctx->initialProcess.process);
-	MSG(2, "System (PID 4):\t%lx (%lx)\n", ctx->initialProcess.process, ctx->initialProcess.physProcess);
+	return ret;
+}
 
-	ctx->ntVersion = GetNTVersion(ctx);
+int InitializeFileContext(WinCtx* ctx, const char* path)
+{
+	memset(ctx, 0, sizeof(WinCtx));
 
-	if (!ctx->ntVersion)
-		return 8;
+	if (MapMemFile(&ctx->process, path))
+		return 1;
 
-	MSG(2, "NT Version:\t%hu\n", ctx->ntVersion);
+	SetMemBackend(&ctx->process, &memBackendFile);
 
-	ctx->ntBuild = GetNTBuild(ctx);
+	MemRegion ram = {
+		.start = 0,
+		.size = ctx->process.mapsSize,
+		.mapping = ctx->process.mapsStart
+	};
 
-	if (!ctx->ntBuild)
-		return 8;
+	SetupMemLayout(&ctx->process, &ram, 1, 0);
 
-	MSG(2, "NT Build:\t%u\n", ctx->ntBuild);
+	int ret = InitializeKernel(ctx);
 
-	if (SetupOffsets(ctx))
-		return 9;
+	if (ret)
+		UnmapMemFile(&ctx->process);
 
-	return 0;
+	return ret;
 }
 
 int FreeContext(WinCtx* ctx)
 {
 	FreeExportList(ctx->ntExports);
+	if (ctx->process.backend.mode == MODE_FILE())
+		UnmapMemFile(&ctx->process);
+	else if (ctx->process.backend.mode == MODE_PROCMEM())
+		CloseProcMem(&ctx->process);
+	else if (ctx->process.backend.mode == MODE_MAPPED())
+		UnmapBackingFiles(&ctx->process);
+	StopMemCacheTimer();
 	return 0;
 }
 
@@ -460,25 +467,291 @@ PEB32 GetPeb32(const WinCtx* ctx, const WinProc* process)
 }
 
 
+/*
+  Treat the largest mapping as the main RAM block. Other large read-write mappings are only added as RAM when they are
+  backed by files in the same directory, since nothing tells anonymous guest memory apart from other big allocations.
+  The host addresses say nothing about the guest order either, thus the files are ordered by name, which fits numbered
+  memory-backend-file objects, and only the largest block is used if two of them share a name. Layouts that can not
+  be told this way have to be set with SetMemLayout.
+*/
+static size_t FindRamBlocks(procmaps_struct* maps, procmaps_struct** blocks, MemRegion* ram, size_t maxCount)
+{
+	procmaps_struct* largest = NULL;
+	size_t count = 0;
+
+	for (procmaps_struct* i = maps; i; i = i->next)
+		if (i->is_r && i->is_w && (!largest || i->length > largest->length))
+			largest = i;
+
+	if (!largest)
+		return 0;
+
+	blocks[count++] = largest;
+
+	if (largest->pathname[0] && largest->pathname[0] != '[') {
+		const char* dirEnd = strrchr(largest->pathname, '/');
+		size_t dirLen = dirEnd ? (size_t)(dirEnd - largest->pathname) + 1 : 0;
+
+		for (procmaps_struct* i = maps; i && count < maxCount; i = i->next) {
+			if (i == largest || !i->is_r || !i->is_w || i->length < MIN_RAM_BLOCK_SIZE)
+				continue;
+			if (!i->pathname[0] || i->pathname[0] == '[' || strncmp(i->pathname, largest->pathname, dirLen))
+				continue;
+
+			/* Insertion sort by name, there are only a handful of blocks */
+			size_t o = count++;
+
+			for (; o > 0 && strcmp(blocks[o - 1]->pathname, i->pathname) > 0; o--)
+				blocks[o] = blocks[o - 1];
+
+			blocks[o] = i;
+		}
+
+		for (size_t i = 1; i < count; i++) {
+			if (!strcmp(blocks[i - 1]->pathname, blocks[i]->pathname)) {
+				blocks[0] = largest;
+				count = 1;
+				break;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		ram[i] = (MemRegion) {
+			.start = 0,
+			.size = blocks[i]->length,
+			.mapping = (uint64_t)blocks[i]->addr_start
+		};
+	}
+
+	return count;
+}
+
+/* Reconstruct the RAM blocks from the region table, in guest order */
+static size_t GetRamBlocks(const ProcessData* data, MemRegion* ram)
+{
+	size_t count = 0;
+
+	for (size_t i = 0; i < data->regionCount; i++) {
+		const MemRegion* region = data->regions + i;
+
+		if (count && ram[count - 1].mapping + ram[count - 1].size == region->mapping)
+			ram[count - 1].size += region->size;
+		else
+			ram[count++] = *region;
+	}
+
+	return count;
+}
+
+/*
+  QEMU leaves a hole below 4GB for PCI devices, and continues the RAM at 4GB.
+  Q35 keeps 2GB of RAM below the hole if the VM has at least 2.75GB of memory, and the PC chipset (which is used for XP) keeps 3GB if it has at least 3.5GB.
+*/
+static void SetupMemLayout(ProcessData* data, const MemRegion* ram, size_t count, int pcLayout)
+{
+	uint64_t total = 0;
+
+	for (size_t i = 0; i < count; i++)
+		total += ram[i].size;
+
+	uint64_t lowSize = total;
+
+	if (pcLayout && total >= 0xe0000000)
+		lowSize = 0xc0000000;
+	else if (!pcLayout && total >= 0xb0000000)
+		lowSize = 0x80000000;
+
+	SetMemLayout(data, ram, count, lowSize, 0x100000000ull);
+
+	for (size_t i = 0; i < data->regionCount; i++)
+		MSG(2, "Region:\t%lx-%lx\t| Mapping:\t%lx\n", data->regions[i].start, data->regions[i].start + data->regions[i].size, data->regions[i].mapping);
+}
+
+static int MapKmod(WinCtx* ctx, MemRegion* ram, size_t count)
+{
+	int fd = open("/proc/vmread", O_RDWR);
+
+	if (fd == -1)
+		return -1;
+
+	MSG(2, "Mapping VM memory, this will take a second...\n");
+
+	MemRegion mappedRam[MAX_MEM_REGIONS / 2];
+	pid_t pid = ctx->process.pid;
+
+	for (size_t i = 0; i < count; i++) {
+		ProcessData mapped = ctx->process;
+		mapped.mapsStart = ram[i].mapping;
+		mapped.mapsSize = ram[i].size;
+
+		int ret = ioctl(fd, VMREAD_IOCTL_MAPVMMEM, &mapped);
+
+		/* The module leaves the data untouched if it fails to map the memory */
+		if (ret || mapped.pid == ctx->process.pid) {
+			close(fd);
+			while (i-- > 0)
+				munmap((void*)mappedRam[i].mapping, mappedRam[i].size);
+			return -1;
+		}
+
+		mappedRam[i] = ram[i];
+		mappedRam[i].mapping = mapped.mapsStart;
+		pid = mapped.pid;
+	}
+
+	close(fd);
+
+	memcpy(ram, mappedRam, sizeof(MemRegion) * count);
+	ctx->process.pid = pid;
+
+	return 0;
+}
+
+/*
+  When QEMU uses memory-backend-file or memfd with share=on, the guest RAM lives in a file we can map ourselves.
+  The file is opened through map_files, which also works for memfd and deleted files, and the mapping is shared,
+  thus reads are plain loads with no syscalls involved. Anonymous or private memory can not be accessed this way.
+*/
+static int MapBackingFiles(pid_t pid, procmaps_struct** blocks, MemRegion* ram, size_t count)
+{
+	void* maps[MAX_MEM_REGIONS / 2];
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		procmaps_struct* block = blocks[i];
+
+		if (!block->pathname[0] || block->pathname[0] == '[' || block->is_p)
+			break;
+
+		char path[128];
+		snprintf(path, sizeof(path), "/proc/%d/map_files/%lx-%lx", pid, (uint64_t)block->addr_start, (uint64_t)block->addr_end);
+
+		int fd = open(path, O_RDWR);
+
+		if (fd == -1)
+			fd = open(block->pathname, O_RDWR);
+
+		if (fd == -1)
+			break;
+
+		maps[i] = mmap(NULL, block->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, block->offset);
+		close(fd);
+
+		if (maps[i] == MAP_FAILED)
+			break;
+
+		MSG(2, "Mapped %s\n", block->pathname);
+	}
+
+	if (i < count) {
+		while (i-- > 0)
+			munmap(maps[i], ram[i].size);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++)
+		ram[i].mapping = (uint64_t)maps[i];
+
+	return 0;
+}
+
+static void UnmapBackingFiles(ProcessData* data)
+{
+	MemRegion ram[MAX_MEM_REGIONS];
+	size_t ramCount = GetRamBlocks(data, ram);
+
+	for (size_t i = 0; i < ramCount; i++)
+		munmap((void*)ram[i].mapping, ram[i].size);
+
+	data->regionCount = 0;
+}
+
+static int InitializeKernel(WinCtx* ctx)
+{
+	uint64_t pml4, kernelEntry;
+
+	MSG(2, "Mem:\t%lx\t| Size:\t%lx\n", ctx->process.mapsStart, ctx->process.mapsSize);
+
+	if (!CheckLow(ctx, &pml4, &kernelEntry, &ctx->process.pagingLevels))
+		return 3;
+
+	MSG(2, "PML4:\t%lx\t| KernelEntry:\t%lx\t| Paging levels:\t%d\n", pml4, kernelEntry, ctx->process.pagingLevels);
+
+	ctx->initialProcess.dirBase = pml4;
+	SetKernelDirBase(pml4);
+	FindNTKernel(ctx, kernelEntry);
+
+	if (!ctx->ntKernel) {
+		/* Test in case we are running XP (QEMU AddressSpace is different) */
+		MemRegion ram[MAX_MEM_REGIONS];
+		size_t ramCount = GetRamBlocks(&ctx->process, ram);
+		SetupMemLayout(&ctx->process, ram, ramCount, 1);
+		FindNTKernel(ctx, kernelEntry);
+
+		if (!ctx->ntKernel)
+			return 4;
+	}
+
+	MSG(2, "Kernel Base:\t%lx (%lx)\n", ctx->ntKernel, VTranslate(&ctx->process, ctx->initialProcess.dirBase, ctx->ntKernel));
+
+	uint64_t initialSystemProcess = FindProcAddress(ctx->ntExports, "PsInitialSystemProcess");
+
+	if (!initialSystemProcess)
+		return 6;
+
+	MSG(2, "PsInitialSystemProcess:\t%lx (%lx)\n", initialSystemProcess, VTranslate(&ctx->process, ctx->initialProcess.dirBase, initialSystemProcess));
+	VMemRead(&ctx->process, ctx->initialProcess.dirBase, (uint64_t)&ctx->initialProcess.process, initialSystemProcess, sizeof(uint64_t));
+
+	if (!ctx->initialProcess.process)
+		return 7;
+
+	ctx->initialProcess.physProcess = VTranslate(&ctx->process, ctx->initialProcess.dirBase, ctx->initialProcess.process);
+	MSG(2, "System (PID 4):\t%lx (%lx)\n", ctx->initialProcess.process, ctx->initialProcess.physProcess);
+
+	ctx->ntVersion = GetNTVersion(ctx);
+
+	if (!ctx->ntVersion)
+		return 8;
+
+	MSG(2, "NT Version:\t%hu\n", ctx->ntVersion);
+
+	ctx->ntBuild = GetNTBuild(ctx);
+
+	if (!ctx->ntBuild)
+		return 8;
+
+	MSG(2, "NT Build:\t%u\n", ctx->ntBuild);
+
+	if (SetupOffsets(ctx))
+		return 9;
+
+	return 0;
+}
+
 /*
   The low stub (if exists), contains PML4 (kernel DirBase) and KernelEntry point.
+  CR4 is stored right after CR3, its LA57 bit tells whether the kernel runs with 5-level paging.
   Credits: PCILeech
 */
-static int CheckLow(const WinCtx* ctx, uint64_t* pml4, uint64_t* kernelEntry)
+static int CheckLow(const WinCtx* ctx, uint64_t* pml4, uint64_t* kernelEntry, int* pagingLevels)
 {
 	int i, o;
 	char buf[0x10000];
 	for (i = 0; i < 10; i++) {
 		MemRead(&ctx->process, (uint64_t)buf, i * 0x10000, 0x10000);
 		for (o = 0; o < 0x10000; o += 0x1000) {
+			int la57 = (*(uint64_t*)(void*)(buf + o + 0xa8) >> 12) & 1;
+			uint64_t kernelMask = la57 ? 0xff00000000000000 : 0xfffff80000000000;
 			if(0x00000001000600E9 ^ (0xffffffffffff00ff & *(uint64_t*)(void*)(buf + o)))
 				continue;
-			if(0xfffff80000000000 ^ (0xfffff80000000000 & *(uint64_t*)(void*)(buf + o + 0x70)))
+			if(kernelMask ^ (kernelMask & *(uint64_t*)(void*)(buf + o + 0x70)))
 				continue;
 			if(0xffffff0000000fff & *(uint64_t*)(void*)(buf + o + 0xa0))
 				continue;
 			*pml4 = *(uint64_t*)(void*)(buf + o + 0xa0);
 			*kernelEntry = *(uint64_t*)(void*)(buf + o + 0x70);
+			*pagingLevels = la57 ? 5 : 4;
 			return 1;
 		}
 	}
@@ -98,6 +98,42 @@ typedef struct WinCtx
  */
 int InitializeContext(WinCtx* ctx, pid_t pid);
 
+/**
+ * @brief Initialize the vmread context with a specific memory backend
+ *
+ * @param ctx context to be initialized
+ * @param pid target process ID
+ * @param mode memory backend to use (one of the MODE_ values)
+ *
+ * MODE_AUTO picks the fastest available backend: direct access when
+ * running inside the target process, kernel module mapping when
+ * /proc/vmread exists, a mapping of the shared memory backend file
+ * when QEMU uses one, and process_vm_readv otherwise.
+ * Other values force the specific backend, MODE_PROCMEM (pread on
+ * /proc/<pid>/mem) is only used when requested.
+ *
+ * @return
+ * 0 if initialization was successful;
+ * otherwise, the return value is an error value.
+ */
+int InitializeContextMode(WinCtx* ctx, pid_t pid, int mode);
+
+/**
+ * @brief Initialize the vmread context from a memory image file
+ *
+ * @param ctx context to be initialized
+ * @param path path to the raw guest physical memory image
+ *
+ * The image is mapped into the process and all memory operations are
+ * performed against it, which allows to reproduce issues and benchmark
+ * without a running VM.
+ *
+ * @return
+ * 0 if initialization was successful;
+ * otherwise, the return value is an error value.
+ */
+int InitializeFileContext(WinCtx* ctx, const char* path);
+
 /**
  * @brief Free the vmread context
  *